@@ -30,7 +30,9 @@
 
 #include <afxres.h>
 #include <shellapi.h>
+#include <shlobj.h>
 #include <commdlg.h>
+#include <dbt.h>
 
 #include <limits.h>
 
@@ -42,25 +44,28 @@
 
 typedef unsigned char byte;
 
-#include "serial.h"
-
 using namespace winclass;
 
 #pragma comment(lib, "shlwapi.lib")
 #pragma comment(lib, "comctl32.lib")
 
-#define CTRL(x)		        (x - 'A' + 1)
-
 static const TCHAR org[] = _T("BridgePoint");
 static const TCHAR app[] = _T("ReaderConsole");
 static const TCHAR title[] = _T("Reader Configuration Console");
 
-
-#define IDLE_TIMEOUT            100
-#define CONSOLE_TIMEOUT         500
-
-#define CMD_TIMEOUT		500
-#define LINE_TIMEOUT		20
+#include "compat.h"
+#include "comm.h"
+#include "ring.h"
+#include "ports.h"
+#include "channel.h"
+#include "scrollback.h"
+#include "srecord.h"
+#include "stats.h"
+#include "macro.h"
+#include "reader.h"
+#include "gang.h"
+#include "probe.h"
+#include "batch.h"
 
 //=========================================================================
 // Window routines.
@@ -149,14 +154,6 @@ OFNHookProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
   return 0;
 }
 
-struct TTY 
-{
-  SerialPort comm;
-  BOOL echo;
-  BOOL pause;
-  int lineDelay;
-};
-
 //=========================================================================
 // Main program
 //
@@ -218,6 +215,10 @@ struct SerialDlg : public Dialog
         Edit_SetSel(GetDlgItem(hwnd, IDC_LINEDELAY), 0, -1);
         return;
       }
+      if (delay != _settings->lineDelay) {
+        // Operator knows better; start learning again from here.
+        memset(_settings->learned, 0, sizeof(_settings->learned));
+      }
       _settings->lineDelay = delay;
       EndDialog(hwnd, IDOK);
     }
@@ -227,102 +228,345 @@ struct SerialDlg : public Dialog
   }
 };
 
-#define MAXOUT          200000
+#define OUTPUT_RING     65536   // Reader output waiting to be shown.
+#define OUTPUT_INTERVAL 30      // ms between repaints of new output.
+#define KEYS_RING       65536   // Typed and pasted keys waiting to go out.
+#define IDT_OUTPUT      1
+
+#define VIEW_CLASS      _T("ReaderConsoleView")
+#define VIEW_LINE       1024    // Most of a line drawn.
+#define VIEW_TAB        8
+#define VIEW_COPY       (16 * 1024 * 1024)
+
+/*
+ * Column that byte i of a line is drawn in.
+ */
+static int
+ViewColumn(const char *src, int i)
+{
+  int j, col = 0;
+
+  for (j = 0; j < i; j++) {
+    col = (src[j] == '\t') ? (col / VIEW_TAB + 1) * VIEW_TAB : col + 1;
+  }
+  return col;
+}
+
+/*
+ * Byte of a line drawn at column col.
+ */
+static int
+ViewByte(const char *src, int len, int col)
+{
+  int i, at = 0;
+
+  for (i = 0; i < len; i++) {
+    at = (src[i] == '\t') ? (at / VIEW_TAB + 1) * VIEW_TAB : at + 1;
+    if (at > col) { break; }
+  }
+  return i;
+}
+
+static int
+ViewExpand(const char *src, int len, char *dst)
+{
+  int i, n = 0;
+
+  for (i = 0; i < len && n < VIEW_LINE; i++) {
+    if (src[i] != '\t') {
+      dst[n++] = src[i];
+      continue;
+    }
+    do { dst[n++] = ' '; } while (n % VIEW_TAB != 0 && n < VIEW_LINE);
+  }
+  return n;
+}
 
+/*
+ * The console.  Draws only the lines in view, straight from _history,
+ * so it costs the same however long the session has run.  Keys typed
+ * go to the reader; selection and copy are by mouse and the usual keys.
+ *
+ * Only the reader thread touches the port, so keys wait in _keys for
+ * it to send them.
+ */
 struct OutputWindow : public Window
 {
   TTY &_tty;
 
-  OutputWindow(TTY &tty) : _tty(tty) {}
+  Ring _ring;
+  char *_batch;
+  Ring _keys;
 
-  void ShowOutput(char *src, int len)
+  Scrollback _history;  // Everything shown, as it is shown.
+
+  HFONT _font;
+  SIZE _cell;           // Size of a character in _font.
+  int _rows, _cols;     // Whole characters that fit.
+  DWORD _top;           // Line at the top.
+  int _left;            // Column at the left.
+  BOOL _follow;         // Keep the newest line in view.
+  ULONGLONG _anchor, _caret;    // Selection, as offsets into _history.
+  char *_text, *_cells; // A line, and a line as drawn.
+
+  OutputWindow(TTY &tty) : _tty(tty), _ring(OUTPUT_RING), _keys(KEYS_RING)
   {
-    int i;
-    
-    if (_tty.pause) { return; }
-    
-    // Emitting characters one-by-one was taking forever in edit control.
-    //
+    _batch = new char[OUTPUT_RING + 1];
+    _text = new char[VIEW_LINE];
+    _cells = new char[VIEW_LINE];
+    _font = (HFONT) GetStockObject(OEM_FIXED_FONT);
+    _cell.cx = 8;
+    _cell.cy = 16;
+    _rows = _cols = 0;
+    _top = 0;
+    _left = 0;
+    _follow = TRUE;
+    _anchor = _caret = 0;
+  }
+
+  ~OutputWindow()
+  {
+    delete [] _batch;
+    delete [] _text;
+    delete [] _cells;
+  }
+
+  /*
+   * Put the console in place of the dialog's control id, in the same
+   * place in the tab order, so it is laid out and resized as that was.
+   */
+  void Create(HWND dlg, int id)
+  {
+    HWND old = GetDlgItem(dlg, id), hwnd;
+    WNDCLASS wc = {0};
+    RECT rc;
+
+    wc.lpfnWndProc = ::DefWindowProc;
+    wc.hInstance = GetModuleHandle(NULL);
+    wc.hCursor = LoadCursor(NULL, IDC_IBEAM);
+    wc.lpszClassName = VIEW_CLASS;
+    RegisterClass(&wc);
+
+    GetWindowPos(old, &rc);
+    hwnd = CreateWindowEx(WS_EX_CLIENTEDGE, VIEW_CLASS, NULL,
+        WS_CHILD | WS_VISIBLE | WS_TABSTOP | WS_VSCROLL | WS_HSCROLL,
+        rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top,
+        dlg, (HMENU) (INT_PTR) id, wc.hInstance, NULL);
+    SetWindowPos(hwnd, old, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE);
+    DestroyWindow(old);
+
+    Attach(dlg, id);
+  }
 
+  /*
+   * Queue output from the reader thread.  It is shown by Flush() on
+   * the GUI thread, which runs off a timer, so a chatty reader costs one
+   * repaint per OUTPUT_INTERVAL however it dribbles in.
+   *
+   * If the GUI falls that far behind, wait for it rather than lose
+   * output, unless the window has gone away.
+   */
+  void PostOutput(const char *src, int len)
+  {
+    int put;
+
+    if (_tty.pause) { return; }
     if (len < 0) { len = lstrlenA(src); }
-    
-    DWORD start, end;
-    Edit_GetSel(_hwnd, &start, &end);
-    if (start == end) {
-      // Move cursor to end
-      Edit_SetSel(_hwnd, INT_MAX, INT_MAX);
+
+    while (len > 0) {
+      put = _ring.Put(src, len);
+      src += put;
+      len -= put;
+      if (len > 0) {
+        if (IsWindow(_hwnd) == FALSE) { return; }
+        Sleep(OUTPUT_INTERVAL);
+      }
     }
-    
+  }
+
+  /*
+   * Show everything queued by PostOutput() in one go.
+   */
+  void Flush()
+  {
+    int len;
+
+    if (_ring.Used() == 0) { return; }
+
+    len = _ring.Get(_batch, OUTPUT_RING);
+    ShowOutput(_batch, len);
+  }
+
+  void ShowOutput(const char *src, int len)
+  {
+    if (_tty.pause) { return; }
+    if (len < 0) { len = lstrlenA(src); }
+
+    Put(src, len);
+    Refresh();
+  }
+
+  /*
+   * Add to _history what the console shows for src: line ends as
+   * "\r\n", control characters as "^X", backspace rubbing out.
+   */
+  void Put(const char *src, int len)
+  {
+    char tmp[3];
+    byte ch = 0;
+    int i;
+
     while (len > 0) {
-      byte ch = 0;
-      
-      // Find a character that needs to be handled specially.
-      //
+      // Plain text goes in as one run.
       for (i = 0; i < len; i++) {
         ch = src[i];
-        if (ch == '\r' && src[i + 1] == '\n') {
-          i++;
-          continue;
-        } 
-        if (ch == '\t' || ch >= 32) {
-          continue;
-        }
-        break;
-      }
-      
-      // Emit all characters before the special character.
-      //
-      if (i > 0) {
-        char old = src[i];
-        src[i] = 0;
-        Edit_ReplaceSelA(_hwnd, src);
-        src[i] = old;
+        if (ch != '\t' && ch < 32) { break; }
       }
-      
-      // Emit the special character.
-      //
-      if (i < len) {
-        if (ch == '\x07') {
-          MessageBeep(0);
-        } else if (ch == '\x08') {
-          Edit_GetSel(_hwnd, &start, &end);
-          start--;
-          Edit_SetSel(_hwnd, start, end);
-          Edit_ReplaceSelA(_hwnd, "");
-        } else if (ch == '\r') {
-          ;
-        } else if (ch == '\n') {
-          Edit_ReplaceSelA(_hwnd, "\r\n");
-        } else {
-          char tmp[10];
-          
-          StringCchPrintfA(tmp, _countof(tmp), "^%c", ch + 64);
-          Edit_ReplaceSelA(_hwnd, tmp);
-        }
-        i++;
+      _history.Append(src, i);
+      if (i == len) { break; }
+
+      if (ch == '\x07') {
+        MessageBeep(0);
+      } else if (ch == '\x08') {
+        _history.Unput();
+      } else if (ch == '\r') {
+        ;
+      } else if (ch == '\n') {
+        _history.Append("\r\n", 2);
+      } else {
+        StringCchPrintfA(tmp, _countof(tmp), "^%c", ch + 64);
+        _history.Append(tmp, 2);
       }
-      
-      src += i;
-      len -= i; 
+      src += i + 1;
+      len -= i + 1;
     }
+  }
+
+  void Clear()
+  {
+    _history.Clear();
+    _top = 0;
+    _left = 0;
+    _anchor = _caret = 0;
+    _follow = TRUE;
+    Refresh();
+  }
 
-    if (GetWindowTextLengthW(_hwnd) > MAXOUT) {
-      Edit_SetSel(_hwnd, 0, MAXOUT / 10);
-      Edit_ReplaceSelA(_hwnd, "");
-      Edit_SetSel(_hwnd, INT_MAX, INT_MAX);
+  /*
+   * After output, keep up with it if the newest line was in view.
+   */
+  void Refresh()
+  {
+    ScrollTo(_follow ? Bottom() : (LONGLONG) _top);
+    HScrollTo(_left);
+    InvalidateRect(_hwnd, NULL, FALSE);
+  }
+
+  LONGLONG Bottom()
+  {
+    return max((LONGLONG) _history.FirstLine(), (LONGLONG) _history.LastLine() - max(_rows, 1) + 1);
+  }
+
+  void ScrollTo(LONGLONG top)
+  {
+    SCROLLINFO si = { sizeof(si), SIF_RANGE | SIF_PAGE | SIF_POS };
+    LONGLONG bottom = Bottom();
+
+    top = max(min(top, bottom), (LONGLONG) _history.FirstLine());
+    _follow = (top == bottom);
+    if ((DWORD) top != _top) {
+      _top = (DWORD) top;
+      InvalidateRect(_hwnd, NULL, FALSE);
     }
-    
-    
-    Edit_ScrollCaret(_hwnd);
+
+    si.nMax = _history._lineCount - 1;
+    si.nPage = max(_rows, 1);
+    si.nPos = (int) (_top - _history.FirstLine());
+    SetScrollInfo(_hwnd, SB_VERT, &si, TRUE);
   }
-  
+
+  void ScrollBy(int lines)
+  {
+    ScrollTo((LONGLONG) _top + lines);
+  }
+
+  void HScrollTo(int left)
+  {
+    SCROLLINFO si = { sizeof(si), SIF_RANGE | SIF_PAGE | SIF_POS };
+    int widest = min(_history._longest, VIEW_LINE);
+
+    left = max(min(left, widest - _cols + 1), 0);
+    if (left != _left) {
+      _left = left;
+      InvalidateRect(_hwnd, NULL, FALSE);
+    }
+
+    si.nMax = widest;
+    si.nPage = max(_cols, 1);
+    si.nPos = _left;
+    SetScrollInfo(_hwnd, SB_HORZ, &si, TRUE);
+  }
+
+  /*
+   * Text of line, up to VIEW_LINE bytes, without its line end.
+   */
+  int GetLine(DWORD line, char *dst)
+  {
+    ULONGLONG start = _history.LineStart(line);
+    int len;
+
+    len = (int) min(_history.LineEnd(line) - start, (ULONGLONG) VIEW_LINE);
+    len = _history.Read(start, dst, len);
+    while (len > 0 && (dst[len - 1] == '\n' || dst[len - 1] == '\r')) { len--; }
+    return len;
+  }
+
+  /*
+   * Offset into _history of the character at x, y.
+   */
+  ULONGLONG HitTest(int x, int y)
+  {
+    LONGLONG line = (LONGLONG) _top + ((y < 0) ? -1 : y / _cell.cy);
+    int len;
+
+    line = max(min(line, (LONGLONG) _history.LastLine()), (LONGLONG) _history.FirstLine());
+    len = GetLine((DWORD) line, _text);
+    return _history.LineStart((DWORD) line)
+        + ViewByte(_text, len, _left + max(x + _cell.cx / 2, 0) / _cell.cx);
+  }
+
   LRESULT WindowProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
   {
     switch (msg) {
       HANDLE_MSG(hwnd, WM_KEYDOWN, OnKeyDown);
       HANDLE_MSG(hwnd, WM_CHAR, OnChar);
+      HANDLE_MSG(hwnd, WM_COPY, OnCopy);
       HANDLE_MSG(hwnd, WM_PASTE, OnPaste);
       HANDLE_MSG(hwnd, WM_SETFOCUS, OnSetFocus);
+      HANDLE_MSG(hwnd, WM_GETDLGCODE, OnGetDlgCode);
+      HANDLE_MSG(hwnd, WM_SETFONT, OnSetFont);
+      HANDLE_MSG(hwnd, WM_GETFONT, OnGetFont);
+      HANDLE_MSG(hwnd, WM_SIZE, OnSize);
+      HANDLE_MSG(hwnd, WM_ERASEBKGND, OnEraseBkgnd);
+      HANDLE_MSG(hwnd, WM_PAINT, OnPaint);
+      HANDLE_MSG(hwnd, WM_VSCROLL, OnVScroll);
+      HANDLE_MSG(hwnd, WM_HSCROLL, OnHScroll);
+      HANDLE_MSG(hwnd, WM_LBUTTONDOWN, OnLButtonDown);
+      HANDLE_MSG(hwnd, WM_MOUSEMOVE, OnMouseMove);
+      HANDLE_MSG(hwnd, WM_LBUTTONUP, OnLButtonUp);
+      HANDLE_MSG(hwnd, WM_CONTEXTMENU, OnContextMenu);
+
+      case WM_MOUSEWHEEL:
+        ScrollBy(-GET_WHEEL_DELTA_WPARAM(wParam) * 3 / WHEEL_DELTA);
+        return 0;
+
+      // Edit menu.
+      case WM_CUT:
+        OnCopy(hwnd);
+        return 0;
+      case EM_SETSEL:
+        if ((int) lParam == -1) { SelectAll(); }
+        return 0;
     }
     return DefWindowProc(msg, wParam, lParam);
   }
@@ -335,23 +579,220 @@ struct OutputWindow : public Window
     if (hwndOldFocus == NULL) { SetFocus(hwnd); }
     DefWindowProc();
   }
-  
+
+  UINT OnGetDlgCode(HWND hwnd, LPMSG lpmsg)
+  {
+    // Enter, Esc and Tab are for the reader, not the dialog.
+    return DLGC_WANTALLKEYS | DLGC_WANTARROWS | DLGC_WANTCHARS | DLGC_WANTTAB;
+  }
+
+  void OnSetFont(HWND hwndCtl, HFONT hfont, BOOL fRedraw)
+  {
+    HDC dc = GetDC(_hwnd);
+    HFONT old = SelectFont(dc, hfont);
+    TEXTMETRIC tm;
+
+    GetTextMetrics(dc, &tm);
+    SelectFont(dc, old);
+    ReleaseDC(_hwnd, dc);
+
+    _font = hfont;
+    _cell.cx = max(tm.tmAveCharWidth, 1);
+    _cell.cy = max(tm.tmHeight, 1);
+    OnSize(_hwnd, SIZE_RESTORED, 0, 0);
+    if (fRedraw) { InvalidateRect(_hwnd, NULL, FALSE); }
+  }
+
+  HFONT OnGetFont(HWND hwnd)
+  {
+    return _font;
+  }
+
+  void OnSize(HWND hwnd, UINT state, int cx, int cy)
+  {
+    RECT rc;
+
+    GetClientRect(hwnd, &rc);
+    _rows = rc.bottom / _cell.cy;
+    _cols = rc.right / _cell.cx;
+    Refresh();
+  }
+
+  BOOL OnEraseBkgnd(HWND hwnd, HDC hdc)
+  {
+    return TRUE;
+  }
+
+  void OnPaint(HWND hwnd)
+  {
+    PAINTSTRUCT ps;
+    HDC dc = BeginPaint(hwnd, &ps);
+    HFONT old = SelectFont(dc, _font);
+    RECT rc;
+    int row;
+
+    GetClientRect(hwnd, &rc);
+    for (row = ps.rcPaint.top / _cell.cy; row * _cell.cy < ps.rcPaint.bottom; row++) {
+      rc.top = row * _cell.cy;
+      rc.bottom = rc.top + _cell.cy;
+      if ((LONGLONG) _top + row > (LONGLONG) _history.LastLine()) {
+        FillRect(dc, &rc, GetSysColorBrush(COLOR_WINDOW));
+      } else {
+        PaintLine(dc, _top + row, &rc);
+      }
+    }
+
+    SelectFont(dc, old);
+    EndPaint(hwnd, &ps);
+  }
+
+  void PaintLine(HDC dc, DWORD line, RECT *rc)
+  {
+    ULONGLONG start = _history.LineStart(line);
+    ULONGLONG a = min(_anchor, _caret), b = max(_anchor, _caret);
+    int len, n, c0, c1, x = -_left * _cell.cx;
+    RECT sel;
+
+    len = GetLine(line, _text);
+    n = ViewExpand(_text, len, _cells);
+
+    SetTextColor(dc, GetSysColor(COLOR_WINDOWTEXT));
+    SetBkColor(dc, GetSysColor(COLOR_WINDOW));
+    ExtTextOutA(dc, x, rc->top, ETO_OPAQUE | ETO_CLIPPED, rc, _cells, n, NULL);
+
+    if (a == b || b <= start || a > start + len) { return; }
+
+    c0 = ViewColumn(_text, (int) (max(a, start) - start));
+    c1 = ViewColumn(_text, (int) (min(b, start + len) - start));
+    if (b > start + len && line < _history.LastLine()) { c1++; }   // The line end.
+    c0 = min(c0, n);
+
+    sel = *rc;
+    sel.left = max(x + c0 * _cell.cx, rc->left);
+    sel.right = min(x + c1 * _cell.cx, rc->right);
+    SetTextColor(dc, GetSysColor(COLOR_HIGHLIGHTTEXT));
+    SetBkColor(dc, GetSysColor(COLOR_HIGHLIGHT));
+    ExtTextOutA(dc, x + c0 * _cell.cx, rc->top, ETO_OPAQUE | ETO_CLIPPED, &sel,
+        _cells + c0, min(c1, n) - c0, NULL);
+  }
+
+  void OnVScroll(HWND hwnd, HWND hwndCtl, UINT code, int pos)
+  {
+    SCROLLINFO si = { sizeof(si), SIF_TRACKPOS };
+
+    switch (code) {
+      case SB_LINEUP:   ScrollBy(-1); break;
+      case SB_LINEDOWN: ScrollBy(1); break;
+      case SB_PAGEUP:   ScrollBy(-_rows); break;
+      case SB_PAGEDOWN: ScrollBy(_rows); break;
+      case SB_TOP:      ScrollTo(_history.FirstLine()); break;
+      case SB_BOTTOM:   ScrollTo(Bottom()); break;
+      case SB_THUMBTRACK:
+        // Scroll positions are only 16 bits in pos.
+        GetScrollInfo(hwnd, SB_VERT, &si);
+        ScrollTo((LONGLONG) _history.FirstLine() + si.nTrackPos);
+        break;
+    }
+  }
+
+  void OnHScroll(HWND hwnd, HWND hwndCtl, UINT code, int pos)
+  {
+    SCROLLINFO si = { sizeof(si), SIF_TRACKPOS };
+
+    switch (code) {
+      case SB_LINELEFT:  HScrollTo(_left - 1); break;
+      case SB_LINERIGHT: HScrollTo(_left + 1); break;
+      case SB_PAGELEFT:  HScrollTo(_left - _cols); break;
+      case SB_PAGERIGHT: HScrollTo(_left + _cols); break;
+      case SB_THUMBTRACK:
+        GetScrollInfo(hwnd, SB_HORZ, &si);
+        HScrollTo(si.nTrackPos);
+        break;
+    }
+  }
+
+  void OnLButtonDown(HWND hwnd, BOOL fDoubleClick, int x, int y, UINT keyFlags)
+  {
+    SetFocus(hwnd);
+    SetCapture(hwnd);
+    _caret = HitTest(x, y);
+    if ((keyFlags & MK_SHIFT) == 0) { _anchor = _caret; }
+    InvalidateRect(hwnd, NULL, FALSE);
+  }
+
+  void OnMouseMove(HWND hwnd, int x, int y, UINT keyFlags)
+  {
+    if (GetCapture() != hwnd) { return; }
+
+    // Dragging off the top or bottom scrolls.
+    if (y < 0) { ScrollBy(-1); }
+    if (y >= _rows * _cell.cy) { ScrollBy(1); }
+
+    _caret = HitTest(x, y);
+    InvalidateRect(hwnd, NULL, FALSE);
+  }
+
+  void OnLButtonUp(HWND hwnd, int x, int y, UINT keyFlags)
+  {
+    ReleaseCapture();
+  }
+
+  void OnContextMenu(HWND hwnd, HWND hwndContext, UINT xPos, UINT yPos)
+  {
+    HMENU menu = CreatePopupMenu();
+    UINT id;
+
+    AppendMenu(menu, (_anchor == _caret) ? MF_GRAYED : MF_ENABLED, ID_EDIT_COPY, _T("&Copy"));
+    AppendMenu(menu, MF_ENABLED, ID_EDIT_PASTE, _T("&Paste"));
+    AppendMenu(menu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(menu, MF_ENABLED, ID_EDIT_SELECT_ALL, _T("Select &All"));
+
+    id = TrackPopupMenu(menu, TPM_RETURNCMD | TPM_RIGHTBUTTON, (short) xPos, (short) yPos, 0, hwnd, NULL);
+    DestroyMenu(menu);
+
+    if (id == ID_EDIT_COPY) { OnCopy(hwnd); }
+    if (id == ID_EDIT_PASTE) { OnPaste(hwnd); }
+    if (id == ID_EDIT_SELECT_ALL) { SelectAll(); }
+  }
+
+  void SelectAll()
+  {
+    _anchor = _history.LineStart(_history.FirstLine());
+    _caret = _history._total;
+    InvalidateRect(_hwnd, NULL, FALSE);
+  }
+
   void OnKeyDown(HWND hwnd, UINT vk, BOOL fDown, int cRepeat, UINT flags) 
   {
-    // In Edit control, 
-    // 1. ESC normally sends WM_CLOSE to parent.  Suppress.
-    // 2. TAB normally sends WM_NEXTDLGCTL to parent.  Change it so
-    // we keep the tab, but Ctrl+Tab sends WM_NEXTDLGCTL.
+    BOOL ctrl = (GetKeyState(VK_CONTROL) & 0x8000) != 0;
+
+    // TAB goes to the reader, but Ctrl+TAB moves on in the dialog.
+    // Other keys scroll.
     //
-    if (vk == VK_ESCAPE) { return; }
-    if (vk == VK_TAB) { 
-      if (GetKeyState(VK_CONTROL) & 0x8000) {
-        SendMessage(GetParent(hwnd), WM_NEXTDLGCTL, GetKeyState(VK_SHIFT) & 0x8000, 0);
-      }
-      return;
+    switch (vk) {
+      case VK_TAB:
+        if (ctrl) {
+          SendMessage(GetParent(hwnd), WM_NEXTDLGCTL, GetKeyState(VK_SHIFT) & 0x8000, 0);
+        }
+        break;
+      case VK_UP:    ScrollBy(-1); break;
+      case VK_DOWN:  ScrollBy(1); break;
+      case VK_PRIOR: ScrollBy(-_rows); break;
+      case VK_NEXT:  ScrollBy(_rows); break;
+      case VK_LEFT:  HScrollTo(_left - 1); break;
+      case VK_RIGHT: HScrollTo(_left + 1); break;
+      case VK_HOME:
+        if (ctrl) { ScrollTo(_history.FirstLine()); }
+        HScrollTo(0);
+        break;
+      case VK_END:
+        if (ctrl) { ScrollTo(Bottom()); }
+        break;
+      case VK_INSERT:
+        if (ctrl) { OnCopy(hwnd); }
+        if (GetKeyState(VK_SHIFT) & 0x8000) { OnPaste(hwnd); }
+        break;
     }
-    
-    DefWindowProc();
   }
   
   void OnChar(HWND hwnd, TCHAR ch, int cRepeat)
@@ -364,38 +805,83 @@ struct OutputWindow : public Window
     }
     if (ch == CTRL('S') || ch == CTRL('Q')) { return; }
     
-    if (ch == CTRL('C') || ch == CTRL('X') || ch == CTRL('V')) { 
-      DefWindowProc(); 
+    if (ch == CTRL('C') || ch == CTRL('X')) {
+      OnCopy(hwnd);
+      return;
+    }
+    if (ch == CTRL('V')) {
+      OnPaste(hwnd);
       return;
     }
     if (ch == CTRL('A')) {
-      Edit_SetSel(hwnd, 0, -1);
+      SelectAll();
       return;
     }
     if (_tty.echo) { 
-      if (ch == '\t') { 
-        // Manually insert Tab here, since an edit embedded in a 
-        // dialog normally ignores WM_CHAR(Tab).
-        
-        Edit_ReplaceSel(hwnd, _T("\t"));
-      }
-      DefWindowProc(); 
+      // Enter shows as a new line.
+      Echo((c == '\r') ? "\n" : &c, 1);
     }
-    _tty.comm.Write(&c, 1);
+    Send(&c, 1);
+  }
+
+  /*
+   * Queue keys for the reader thread.  What does not fit is dropped.
+   */
+  void Send(const char *src, int len)
+  {
+    if (_keys.Put(src, len) < len) { MessageBeep(0); }
+  }
+
+  /*
+   * Show what was typed, after what the reader has already said.
+   */
+  void Echo(const char *src, int len)
+  {
+    Flush();
+    Put(src, len);
+    _follow = TRUE;
+    Refresh();
+  }
+
+  /*
+   * Newest VIEW_COPY bytes of the selection.  Save Console Log has it all.
+   */
+  void OnCopy(HWND hwnd)
+  {
+    ULONGLONG a = min(_anchor, _caret), b = max(_anchor, _caret);
+    HGLOBAL h;
+    char *dst;
+    int len;
+
+    if (a == b) { return; }
+
+    len = (int) min(b - a, (ULONGLONG) VIEW_COPY);
+    h = GlobalAlloc(GMEM_MOVEABLE, len + 1);
+    if (h == NULL) { return; }
+    dst = (char *) GlobalLock(h);
+    len = _history.Read(b - len, dst, len);
+    dst[len] = '\0';
+    GlobalUnlock(h);
+
+    if (OpenClipboard(hwnd) == FALSE) {
+      GlobalFree(h);
+      return;
+    }
+    EmptyClipboard();
+    if (SetClipboardData(CF_TEXT, h) == NULL) { GlobalFree(h); }
+    CloseClipboard();
   }
   
   void OnPaste(HWND hwnd)
   {
-    Edit_SetSel(hwnd, (UINT) -2, (UINT) -2);
-    if (_tty.echo) {
-      DefWindowProc();
-    }
-    
     OpenClipboard(hwnd);
     HGLOBAL h = GetClipboardData(CF_TEXT);
     if (h != NULL) {
       char *src = (char *) GlobalLock(h);
-      _tty.comm.Write(src, lstrlenA(src));
+      if (_tty.echo) {
+        Echo(src, lstrlenA(src));
+      }
+      Send(src, lstrlenA(src));
       GlobalUnlock(h);
     }
     CloseClipboard();
@@ -403,36 +889,37 @@ struct OutputWindow : public Window
 };
 
 
-#define MAXCOM		256
+#define MAXCOM		PORTS_MAX
+#define UNPLUGGED_TIMEOUT	1000	// ms between looks for an unplugged port.
 
+/*
+ * The port in use stays in the list while it is unplugged, so it is
+ * still the one picked when it comes back.
+ */
 static void 
-FillPortNames(HWND hwnd)
+FillPortNames(HWND hwnd, PortList *list)
 {
-  TCHAR old[10], tmp[10];
-  int i;
+  TCHAR old[PORT_NAME], ports[MAXCOM][PORT_NAME];
+  int i, count;
   
   ComboBox_GetText(hwnd, old, _countof(old));
   SetWindowRedraw(hwnd, FALSE);
   ComboBox_ResetContent(hwnd);
   
-  for (i = 1; i <= MAXCOM; i++) {
-    sprintf_t(tmp, _countof(tmp), _T("COM%d"), i);
-    QueryDosDevice(tmp, NULL, 0);
-    if (GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
-      StringCchCat(tmp, _countof(tmp), _T(":"));
-      ComboBox_AddString(hwnd, tmp);
-    }
+  count = list->Copy(ports, MAXCOM);
+  for (i = 0; i < count; i++) {
+    ComboBox_AddString(hwnd, ports[i]);
   } 
-  if (ComboBox_GetCount(hwnd) == 0) {
-    ComboBox_AddString(hwnd, _T("COM1:"));
+  if (old[0] != '\0' && list->Has(old) == FALSE) {
+    ComboBox_AddString(hwnd, old);
   }
   SetWindowRedraw(hwnd, TRUE);
   ComboBox_SelectString(hwnd, -1, old);
 }
 
-enum { QUITTING, IDLE, CONNECT, CONSOLE, DETECT, REFLASH, PLAYMACRO, RECORDMACRO };
+enum { QUITTING, IDLE, CONNECT, CONSOLE, DETECT, REFLASH, PLAYMACRO, RECORDMACRO, GANGREFLASH, BATCH };
 
-struct ReflashDlg : public Dialog
+struct ReflashDlg : public Dialog, public Reader
 {
   Control ctlPortName;  // Serial port name.
   Control ctlFileName;  // Reflash file name.
@@ -442,28 +929,44 @@ struct ReflashDlg : public Dialog
   OutputWindow ctlOutput;
 
   TCHAR _macroName[MAX_PATH];  
+  TCHAR _logFile[MAX_PATH];  // Session log of every reflash, or "".
+  int _macroUnit;       // $unit for the next command file played.
+  int _batchJobs;       // Ports at once in a batch.
+  char _reboot[32];     // Command that restarts a reader, or "".
 
   SIZE _minSize;	/* Main window min size. */
   SIZE _curSize;	/* Main window current size, for aligning controls. */
   
   BOOL _statusErr;	/* Show status as error? */
+  BOOL _portOpen;	/* As last heard from the reader thread. */
+  PortList _ports;      // Kept current by OnDeviceChange().
   
   HANDLE _thread;       // I/O worker thread.
-  int _threadState;    
-  BOOL _stop;
+  DWORD _guiThread;
+  Slot _commands;       // To the I/O thread; only SetState() posts.
+  Channel _events;      // From the I/O thread; shown by OnTimer().
+  Overflow _late;       // Events that did not fit in _events.
+  LONG _posted;         // Number of the last command posted.
 
-  TTY _tty;
+  // Only the I/O thread touches these.
+  int _threadState;    
+  Message _job;         // Command being carried out.
   
   ReflashDlg() : Dialog(IDD_REFLASH), ctlOutput(_tty)
   {
-    _tty.echo = FALSE;
-    _tty.pause = FALSE;
-
     _macroName[0] = '\0';
+    _logFile[0] = '\0';
+    _macroUnit = 1;
+    _batchJobs = BATCH_JOBS;
+    _reboot[0] = '\0';
 
     _statusErr = 0;
+    _portOpen = FALSE;
     
     _thread = NULL;
+    _guiThread = 0;
+    _posted = 0;
+    _threadState = IDLE;
   }
   
   ~ReflashDlg() 
@@ -498,7 +1001,7 @@ struct ReflashDlg : public Dialog
     //
     ctlEnable = TRUE;
     mnuEnable = MF_ENABLED;
-    if (_tty.comm == NULL) {
+    if (_portOpen == FALSE) {
       ctlEnable = FALSE;
       mnuEnable = MF_GRAYED | MF_DISABLED;
     }
@@ -529,6 +1032,22 @@ struct ReflashDlg : public Dialog
     
     s.WriteInt(_T("echo"), _tty.echo);
     s.WriteInt(_T("line"), _tty.lineDelay);
+    s.WriteInt(_T("window"), _tty.window);
+    s.WriteInt(_T("adaptive"), _tty.adaptive);
+    s.WriteInt(_T("recordSize"), _tty.recordSize);
+    s.WriteInt(_T("verify"), _tty.verify);
+    s.WriteInt(_T("skip"), _tty.skip);
+    s.WriteInt(_T("maxBaud"), _tty.maxBaud);
+    s.WriteInt(_T("macroDepth"), _tty.macroDepth);
+    s.WriteInt(_T("macroUnit"), _macroUnit);
+    s.WriteInt(_T("batchJobs"), _batchJobs);
+    sprintf_t(buf, _countof(buf), _T("%") PRI_AS, _reboot);
+    s.WriteString(_T("reboot"), buf);
+    s.WriteInt(_T("delta"), _cacheDir[0] != '\0');
+    s.WriteInt(_T("spill"), ctlOutput._history._spill != INVALID_HANDLE_VALUE);
+    s.WriteInt(_T("log"), _logFile[0] != '\0');
+    s.WriteInt(_T("delayCMD"), _tty.learned[MODEL_CMD]);
+    s.WriteInt(_T("delay908"), _tty.learned[MODEL_908]);
   }
   
   void RestoreSettings()
@@ -552,8 +1071,91 @@ struct ReflashDlg : public Dialog
     
     _tty.echo = s.GetInt(_T("echo"), 0);
     _tty.lineDelay = s.GetInt(_T("line"), LINE_TIMEOUT);
+    _tty.window = s.GetInt(_T("window"), LINE_WINDOW);
+    _tty.adaptive = s.GetInt(_T("adaptive"), TRUE);
+    _tty.recordSize = s.GetInt(_T("recordSize"), 0);
+    _tty.verify = s.GetInt(_T("verify"), FALSE);
+    _tty.skip = s.GetInt(_T("skip"), FALSE);
+    _tty.maxBaud = s.GetInt(_T("maxBaud"), 0);
+    _tty.macroDepth = s.GetInt(_T("macroDepth"), MACRO_DEPTH);
+    _macroUnit = s.GetInt(_T("macroUnit"), 1);
+    _batchJobs = s.GetInt(_T("batchJobs"), BATCH_JOBS);
+    s.GetString(_T("reboot"), NULL, buf, _countof(buf));
+    StringCchPrintfA(_reboot, _countof(_reboot), "%" PRI_TS, buf);
+    if (s.GetInt(_T("delta"), 0)) { SetCacheDir(); }
+    if (s.GetInt(_T("spill"), 1)) { ctlOutput._history.Spill(); }
+    if (s.GetInt(_T("log"), 1)) { SetLogFile(); }
+    _tty.learned[MODEL_CMD] = s.GetInt(_T("delayCMD"), 0);
+    _tty.learned[MODEL_908] = s.GetInt(_T("delay908"), 0);
   }
   
+  /*
+   * Make and return our own folder called name under the user's local
+   * app data.
+   */
+  BOOL GetAppDir(const TCHAR *name, TCHAR *dir)
+  {
+    if (FAILED(SHGetFolderPath(NULL, CSIDL_LOCAL_APPDATA | CSIDL_FLAG_CREATE, NULL, 0, dir))) {
+      return FALSE;
+    }
+    PathAppend(dir, org);
+    PathAppend(dir, app);
+    PathAppend(dir, name);
+    SHCreateDirectoryEx(NULL, dir, NULL);
+    return PathIsDirectory(dir);
+  }
+
+  /*
+   * Keep the image last programmed into each reader under the user's
+   * local app data, so the next reflash need only send what changed.
+   */
+  void SetCacheDir()
+  {
+    TCHAR dir[MAX_PATH];
+
+    _cacheDir[0] = '\0';
+    if (GetAppDir(_T("Images"), dir)) { strcpy_t(_cacheDir, _countof(_cacheDir), dir); }
+  }
+
+  /*
+   * One log per session, named for when it started, with a line of
+   * ReflashStats for each reader reflashed.
+   */
+  void SetLogFile()
+  {
+    TCHAR dir[MAX_PATH];
+    SYSTEMTIME st;
+
+    _logFile[0] = '\0';
+    if (GetAppDir(_T("Logs"), dir) == FALSE) { return; }
+
+    GetLocalTime(&st);
+    sprintf_t(_logFile, _countof(_logFile), _T("%s\\%04d%02d%02d-%02d%02d%02d.log"), dir,
+        st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+  }
+
+  /*
+   * Fastest rate the reader on each port has managed, kept per port
+   * so the next reflash can go straight to it.
+   */
+  DWORD GetBestBaud(const TCHAR *port)
+  {
+    Settings s(org, app);
+    TCHAR key[64];
+
+    sprintf_t(key, _countof(key), _T("baud.%s"), port);
+    return s.GetInt(key, 0);
+  }
+
+  void SetBestBaud(const TCHAR *port, DWORD baud)
+  {
+    Settings s(org, app);
+    TCHAR key[64];
+
+    sprintf_t(key, _countof(key), _T("baud.%s"), port);
+    s.WriteInt(key, baud);
+  }
+
   /*
    * Display selected file name.
    */
@@ -585,28 +1187,56 @@ struct ReflashDlg : public Dialog
       HANDLE_MSG(hwnd, WM_HELP, OnHelp);
       HANDLE_MSG(hwnd, WM_CLOSE, OnClose);
       HANDLE_MSG(hwnd, WM_COMMAND, OnCommand);
+      HANDLE_MSG(hwnd, WM_TIMER, OnTimer);
 
-//      HANDLE_MSG(hwnd, WM_DEVICECHANGE, OnDeviceChange);
+    case WM_DEVICECHANGE:
+      return OnDeviceChange(hwnd, (UINT) wParam, lParam);
     }
     return FALSE;
   }
 
-/*  BOOL OnDeviceChange(HWND hwnd, UINT uEvent, DWORD dwEventData)
+  /*
+   * A serial port came or went.  Keeps the port list current and, if
+   * it is the port we want, has the reader thread connect again now
+   * rather than find out for itself.  Not while a job runs; that will
+   * fail or finish by itself.
+   */
+  BOOL OnDeviceChange(HWND hwnd, UINT event, LPARAM data)
   {
-    Debug(_T("\nWM_DEVICECHANGE: %d"), uEvent);
-    return FALSE;
-  }*/
+    DEV_BROADCAST_HDR *hdr = (DEV_BROADCAST_HDR *) data;
+    TCHAR name[PORT_NAME], port[PORT_NAME];
+    BOOL arrived = (event == DBT_DEVICEARRIVAL);
+
+    if (arrived == FALSE && event != DBT_DEVICEREMOVECOMPLETE) { return TRUE; }
+    if (hdr == NULL || hdr->dbch_devicetype != DBT_DEVTYP_PORT) { return TRUE; }
+
+    sprintf_t(name, _countof(name), _T("%s:"), ((DEV_BROADCAST_PORT *) hdr)->dbcp_name);
+    if ((arrived ? _ports.Arrived(name) : _ports.Removed(name)) == FALSE) { return TRUE; }
+
+    // A list being picked from is refilled when it next drops down.
+    if (ComboBox_GetDroppedState(ctlPortName)) { return TRUE; }
+    FillPortNames(ctlPortName, &_ports);
+
+    ComboBox_GetText(ctlPortName, port, _countof(port));
+    if (PortList::Same(name, port) && IsWindowEnabled(ctlPortName) && arrived != _portOpen) {
+      if (arrived) { Status(_T("Trying..."), 0); }
+      SetState(CONNECT);
+    }
+    return TRUE;
+  }
   
   BOOL OnInitDialog(HWND hwnd, HWND hwndFocus, LPARAM lParam) 
   {
+    _guiThread = GetCurrentThreadId();
+    SetTimer(hwnd, IDT_OUTPUT, OUTPUT_INTERVAL, NULL);
+
     ctlPortName.Attach(hwnd, IDC_PORT);
     ctlFileName.Attach(hwnd, IDC_FILENAME);
 
     ctlCancel.Attach(hwnd, IDC_CANCEL);
     ctlStatus.Attach(hwnd, IDC_STATUS);
     
-    ctlOutput.Attach(hwnd, IDC_OUTPUT);
-    Edit_LimitText(ctlOutput, 0);
+    ctlOutput.Create(hwnd, IDC_OUTPUT);
    
     SetWindowIcon(hwnd, ICON_BIG, 
         LoadIcon(GetResourceHandle(), IDI_REFLASH, ICON_BIG));
@@ -625,7 +1255,8 @@ struct ReflashDlg : public Dialog
     
     ShowWindow(ctlCancel, SW_HIDE);
     
-    FillPortNames(ctlPortName);   
+    _ports.Refresh();
+    FillPortNames(ctlPortName, &_ports);   
     
     // Restore window to how it was last time program ran.
     RestoreSettings();
@@ -677,6 +1308,61 @@ struct ReflashDlg : public Dialog
     return NULL;
   }	
     
+  void OnTimer(HWND hwnd, UINT id)
+  {
+    Message msg;
+
+    if (id != IDT_OUTPUT) { return; }
+
+    ctlOutput.Flush();
+    while (_events.Get(&msg)) { OnEvent(&msg); }
+    while (_late.Get(&msg)) { OnEvent(&msg); }
+  }
+
+  /*
+   * Show what the reader thread has told us.
+   */
+  void OnEvent(const Message *msg)
+  {
+    TCHAR tmp[MAX_PATH];
+
+    switch (msg->type) {
+    case MSG_STATUS:
+      ShowStatus(msg->text, msg->err);
+      break;
+
+    case MSG_PROGRESS:
+      sprintf_t(tmp, _countof(tmp), _T("line %d/%d"), msg->line, msg->total);
+      ShowStatus(tmp, 0);
+      break;
+
+    case MSG_TITLE:
+      if (msg->port[0] == '\0') {
+        sprintf_t(tmp, _countof(tmp), _T("%s: disconnected"), title);
+      } else {
+        sprintf_t(tmp, _countof(tmp), _T("%s: %s"), title, msg->port);
+      }
+      SetWindowText(_hwnd, tmp);
+      break;
+
+    case MSG_PORT:
+      FillPortNames(ctlPortName, &_ports);
+      ComboBox_SelectString(ctlPortName, -1, msg->port);
+      break;
+
+    case MSG_CONTROLS:
+      _portOpen = msg->state;
+      UpdateControls();
+      if (_portOpen) { SetFocus(ctlOutput); }
+      break;
+
+    case MSG_ENABLE:
+      // Unless something else has been asked for since.
+      if (msg->state == _posted) { EnableUI(TRUE); }
+      break;
+    }
+  }
+
   void OnHelp(HWND hwnd, LPHELPINFO lphi) 
   {
     AboutDlg().DoModal(hwnd);
@@ -684,6 +1370,7 @@ struct ReflashDlg : public Dialog
   
   void OnClose(HWND hwnd)
   {
+    KillTimer(hwnd, IDT_OUTPUT);
     SetState(QUITTING);
     SaveSettings();
     EndDialog(hwnd, 0);
@@ -696,7 +1383,7 @@ struct ReflashDlg : public Dialog
     // Menu commands.
 
     case ID_CLEAR:
-      Edit_SetText(ctlOutput, NULL);
+      ctlOutput.Clear();
       _tty.pause = FALSE;
       UpdateControls();
       SetFocus(ctlOutput);
@@ -802,7 +1489,7 @@ struct ReflashDlg : public Dialog
     if (codeNotify == CBN_DROPDOWN) {
       // Don't try to reconnect while still selecting port.
       SetState(IDLE);
-      FillPortNames(ctlPortName);
+      FillPortNames(ctlPortName, &_ports);
     } else if (codeNotify == CBN_CLOSEUP) {
       Status(_T("Trying..."), 0);
       SetFocus(ctlOutput);
@@ -851,10 +1538,20 @@ struct ReflashDlg : public Dialog
     ShowWindow(ctlCancel, cancel);
   }
 
+  /*
+   * Shift+Reflash programs every reader on every port in the list at
+   * once, for a bench of readers.  Ctrl+Reflash runs them as a batch.
+   */
   void Cmd_Reflash()
   {
     EnableUI(FALSE);
-    SetState(REFLASH);
+    if (GetKeyState(VK_CONTROL) & 0x8000) {
+      SetState(BATCH);
+    } else if (GetKeyState(VK_SHIFT) & 0x8000) {
+      SetState(GANGREFLASH);
+    } else {
+      SetState(REFLASH);
+    }
   }
 
   BOOL Cmd_ChooseFile()
@@ -933,13 +1630,9 @@ struct ReflashDlg : public Dialog
     if (save) {
       HANDLE out = CreateFile(buf, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
       if (out != INVALID_HANDLE_VALUE) {
-        DWORD l = GetWindowTextLengthA(ctlOutput);
-        char *p = (char *) LocalAlloc(GPTR, l + 1);
-        if (p != NULL) {
-          GetWindowTextA(ctlOutput, p, l + 1);
-          WriteFile(out, p, l, &l, NULL);
-          LocalFree(p);
-        }
+        // Whole session, not just what is left in the window.
+        ctlOutput.Flush();
+        ctlOutput._history.Save(out);
         CloseHandle(out);
       }
     }
@@ -953,30 +1646,96 @@ struct ReflashDlg : public Dialog
     SerialDlg(&_tty).DoModal(hwnd);
   }
 
-  void Status(const TCHAR *msg, BOOL err = TRUE)
+  void ShowStatus(const TCHAR *msg, BOOL err)
   {
     _statusErr = err;
     SetWindowText(ctlStatus, msg);
   }
 
   /*
-   * Sets the state of the background reader thread.
-   * The reader thread will asynchronously check the state variable and
-   * cleanly move into the desired new state.
+   * Events from the reader thread never wait for the dialog: if it is
+   * that far behind, only the last of each type is kept for it.
+   */
+  void PostEvent(const Message *msg)
+  {
+    _late.Post(&_events, msg);
+  }
+
+  void PostEvent(int type, int state = 0, const TCHAR *port = NULL)
+  {
+    Message msg(type);
+
+    msg.state = state;
+    strcpy_t(msg.port, _countof(msg.port), port);
+    PostEvent(&msg);
+  }
+
+  virtual void Status(const TCHAR *msg, BOOL err = TRUE)
+  {
+    Message event(MSG_STATUS);
+
+    if (GetCurrentThreadId() == _guiThread) {
+      ShowStatus(msg, err);
+      return;
+    }
+    strcpy_t(event.text, _countof(event.text), msg);
+    event.err = err;
+    PostEvent(&event);
+  }
+
+  virtual void Output(char *buf, int len)
+  {
+    ctlOutput.PostOutput(buf, len);
+  }
+
+  /*
+   * Only worth showing if the dialog is keeping up; the next one will
+   * say where it got to.
+   */
+  virtual void Progress(int line, int total)
+  {
+    Message event(MSG_PROGRESS);
+
+    if (_late._count > 0 || _events.Used() >= CHANNEL_SIZE / 2) { return; }
+    event.line = line;
+    event.total = total;
+    _events.Post(&event);
+  }
+
+  /*
+   * Tell the reader thread to go to state, with the port, file and
+   * command file as they are now, and wake it from whatever it is
+   * doing.  The last command wins: one the thread has not yet taken
+   * is dropped without being run.
    */
   void SetState(int state)
   {
+    Message msg(MSG_STATE);
+
     if (state == CONSOLE) { EnableUI(TRUE); }
 
-    _threadState = state;
-    _stop = TRUE;
+    msg.state = state;
+    msg.seq = ++_posted;
+    ComboBox_GetText(ctlPortName, msg.port, _countof(msg.port));
+    GetWindowText(ctlFileName, msg.image, _countof(msg.image));
+    strcpy_t(msg.macro, _countof(msg.macro), _macroName);
+    _commands.Post(&msg);
+    Stop();
   }
   
- 
+  /*
+   * Where the reader thread goes when it is done, from the reader
+   * thread.  A command posted meanwhile still comes after it.
+   */
+  void NextState(int state)
+  {
+    _threadState = state;
+    if (state == CONSOLE) { PostEvent(MSG_ENABLE, _job.seq); }
+  }
   
   void StartReaderThread()
   {
-    _threadState = CONNECT;
+    SetState(CONNECT);
     _thread = CreateThread(NULL, 0, ReaderThread, this, 0, NULL);
   }
   
@@ -988,12 +1747,21 @@ struct ReflashDlg : public Dialog
 
   void ReaderThread()
   {
+    Message msg;
+
     while (1) {
+      // Clear the cancel before taking commands, so one posted in
+      // between still cancels what it finds us doing.
+      InterlockedExchange(&_stop, FALSE);
+      _tty.comm.Reset();
+      if (_commands.Get(&msg)) {
+        _job = msg;
+        _threadState = msg.state;
+      }
       int state = _threadState;
-      _stop = FALSE;
       
       if (state == IDLE) {
-        Sleep(IDLE_TIMEOUT);
+        _tty.comm.Pause(INFINITE);
       } else if (state == CONNECT) {
         Connect();
       } else if (state == CONSOLE) { 
@@ -1004,6 +1772,10 @@ struct ReflashDlg : public Dialog
         Reflash(); 
       } else if (state == PLAYMACRO) {
         PlayMacro();
+      } else if (state == GANGREFLASH) {
+        GangReflash();
+      } else if (state == BATCH) {
+        Batch();
       } else {
         break;
       }
@@ -1012,305 +1784,303 @@ struct ReflashDlg : public Dialog
 
   void Connect()
   {
-    Sleep(IDLE_TIMEOUT);
     if (Port_Connect()) { 
       Status(_T("OK"), 0); 
-      SetState(CONSOLE); 
+      NextState(CONSOLE); 
+    } else if (GetLastError() == ERROR_FILE_NOT_FOUND) {
+      // Unplugged: OnDeviceChange() wakes us when it is back, or
+      // we look again in case the driver does not say.
+      _tty.comm.Pause(UNPLUGGED_TIMEOUT);
+    } else {
+      // Busy: nothing says when it is free, so try again.
+      _tty.comm.Pause(IDLE_TIMEOUT);
     }
   }
   
   
+  /*
+   * Pass on output, and send what was typed.  The read times out often
+   * enough that keys go out as they are typed.
+   */
   void Console()
   {
     char buf[1000];
 
-    _tty.comm.SetTimeout(CONSOLE_TIMEOUT, -1);
+    _tty.comm.SetTimeout(OUTPUT_INTERVAL, -1);
     while (_stop == FALSE) {
-      int len = _tty.comm.Read(buf, sizeof(buf) - 1);
-      
-      if (len == 0) {
-        if (_tty.comm.Error()
-            || (   (GetFileAttributes(_tty.comm.Name()) == -1)
-                && (GetLastError() == ERROR_FILE_NOT_FOUND))) {
-          // usbser.sys: HANDLE is still valid but port name is gone.
-          len = -1;
-        }
+      int len;
+
+      while ((len = ctlOutput._keys.Get(buf, sizeof(buf))) > 0) {
+        _tty.comm.Write(buf, len);
       }
+
+      len = _tty.comm.Read(buf, sizeof(buf) - 1);
+      
+      // An unplugged port that still reads fine (usbser.sys) is
+      // seen to by OnDeviceChange().
+      if (len == 0 && _tty.comm.Error()) { len = -1; }
       
       if (len < 0) { 
-        SetState(CONNECT);
+        NextState(CONNECT);
         break;
       }
       
-      if (len > 0) { ctlOutput.ShowOutput(buf, len); }
+      if (len > 0) { Output(buf, len); }
     }
   }
   
+  /*
+   * Probe every port at once, the current one first so it wins if
+   * several answer.  Our own port is closed while they run.
+   */
   void ScanForReader()
   {
-    TCHAR first[16], name[16];
-    int i, len;
-    
-    GetWindowText(ctlPortName, first, _countof(first));
-    if (ConnectReader(first)) { goto end; }
-    
-    FillPortNames(ctlPortName);
-    
-    len = ComboBox_GetCount(ctlPortName);
-    for (i = 0; i < len; i++) {
-      ComboBox_SetCurSel(ctlPortName, i);
-      GetWindowText(ctlPortName, name, _countof(name));
-      if (lstrcmpi(first, name) == 0) { continue; }
-      if (ConnectReader(name)) { goto end; }
+    TCHAR ports[MAXCOM][PORT_NAME];
+    const TCHAR *names[MAXCOM];
+    Discovery scan;
+    DWORD start;
+    int i, len, count, found;
+
+    len = _ports.Copy(ports, MAXCOM);
+    names[0] = _job.port;
+    count = 1;
+    for (i = 0; (i < len) && (count < MAXCOM); i++) {
+      if (lstrcmpi(_job.port, ports[i]) == 0) { continue; }
+      names[count++] = ports[i];
     }
-    
-    if (GetLastError() != ERROR_ACCESS_DENIED) {
-      Status(_T("No reader found"));
+
+    Status(_T("Looking for reader..."), 0);
+    _tty.comm.Close();
+
+    start = GetTickCount();
+    scan.Start(names, count);
+    while (scan.Wait(IDLE_TIMEOUT) == FALSE) {
+      if (_stop || (GetTickCount() - start >= PROBE_DEADLINE)) { break; }
     }
-    
-    ComboBox_SelectString(ctlPortName, -1, first);
-    Port_Connect();
-    
-end:
-    SetState(CONSOLE);
-    EnableDlgItem(_hwnd, IDC_CONNECT, TRUE);
+    found = scan.Found();
+    scan.Finish();
+
+    if (found >= 0) {
+      strcpy_t(_job.port, _countof(_job.port), names[found]);
+      PostEvent(MSG_PORT, 0, _job.port);
+      if (Port_Connect()) {
+        Status(_T("Connected to Reader"), 0);
+      }
+    } else {
+      // Port_Connect() says if another program has the port.
+      if (scan._probes[0]._err != ERROR_ACCESS_DENIED) {
+        Status(_T("No reader found"));
+      }
+      Port_Connect();
+    }
+
+    NextState(CONSOLE);
   }
-  
-  BOOL ConnectReader(const TCHAR *name)
+
+  /*
+   * Load the S-record file from the dialog.  A bad file is reported
+   * here, before the reader is touched.  If the bootloader takes long
+   * records, short ones are merged so there are fewer lines to send.
+   */
+  BOOL LoadImage(SRecordImage *image, const TCHAR *name = NULL)
   {
-    int i;
-    TCHAR buf[MAX_PATH];
-    
-    StringCchPrintf(buf, _countof(buf), _T("Checking %s"), name);
-    Status(buf, 0);
-    
-    if (Port_Connect() == FALSE) { return FALSE; }
-    
-    for (i = 0; i < 3; i++) {
-      Port_Send("\r");
-      if (Port_Expect("Boot>")) { goto found; }
-      Port_Send("\r");
-      if (Port_Expect("CMD>")) { goto found; }
-  
+    TCHAR fileName[MAX_PATH];
+    SRecordImage file;
+    SRecordImage *load = (_tty.recordSize > 0) ? &file : image;
+
+    strcpy_t(fileName, _countof(fileName), (name != NULL) ? name : _job.image);
+
+    Status(_T("Loading file..."), 0);
+    if (load->Load(fileName) == FALSE) {
+      Status(load->_error);
+      return FALSE;
     }
-    return FALSE;
-    
-found:
-    Status(_T("Connected to Reader"), 0);
-    SetFocus(ctlOutput);
+    if (load == &file) { image->Coalesce(&file, _tty.recordSize); }
     return TRUE;
   }
-  
+
   void Reflash()
   {
-    FILE *file = NULL;
-    TCHAR fileName[MAX_PATH];
-    char tmp[128];
-    int i;
-    TCHAR *msg = NULL;
-    
-    Status(_T("Connecting to reader..."), 0);
-    
-    if (GetWindowText(ctlFileName, fileName, _countof(fileName)) == 0) { 
-badfile:
-      msg = _T("Cannot open file");
-      goto end;
-    }
-    
-    
-    file = _tfopen(fileName, _T("r"));
-    if (file == NULL) { goto badfile; }
-    
-    Port_Send("\r\r\r");
-    if (Port_Expect("CMD>")) {
-      // Try RF command.
-      
-      Port_Send("RF\r");
-      if (Port_Expect("Send File") == FALSE) { goto try908; }
-      Port_Expect(">");
-      
-      if (SendFile(file) == FALSE) {
-        msg = _T("Error sending file");
-        goto end;
-      }
-    } else {
-      // Try 908
-      
-try908:
-      memset(tmp, 27, sizeof(tmp));
-      tmp[sizeof(tmp) - 1] = '\0';
-    
-      Port_Send(tmp);
-      Port_Expect("Boot>");
-    
-      Port_Send("\r\n");
-    
-      if (Port_Expect("Boot>") == FALSE) {
-        msg = _T("Reader didn't accept reflash command");
-        goto end;
-      }
-    
-      Port_Send("w");
-      Port_Expect("Boot>");
-      Port_Send("w");
-      if (Port_Expect("Boot>") == FALSE) { 
-        msg = _T("Could not erase reader");
-        goto end;
-      }
-      Port_Send("p");
-      if (Port_Expect("...") == FALSE) {
-        msg = _T("Reader didn't accept program command");
-        goto end;
-      }
-      Edit_ReplaceSel(ctlOutput, _T(" downloading ..."));
-      if (SendFile(file) == FALSE) {
-        msg = _T("Error sending file");
-        goto end;
-      } 
-      Port_Expect("Boot>");
-      Port_Send("x");
+    SRecordImage image;
+    BOOL ok;
+
+    if (LoadImage(&image)) {
+      _tty.bestBaud = GetBestBaud(_tty.comm.Name());
+      ok = Reader::Reflash(&image);
+      SetBestBaud(_tty.comm.Name(), _tty.bestBaud);
+      if (_logFile[0] != '\0') { _stats.Log(_logFile, _tty.comm.Name(), ok); }
     }
-    
-    for (i = 0; i < 5; i++) {
-      if (Port_Expect("CMD>")) { break; }
-    }
-    
-    Status(_T("Reflash Complete"), 0);
-    
-end:
-    if (_stop) { msg = _T("Reflash Cancelled"); }
-    
-    if (file != NULL) { fclose(file); }
-    if (msg != NULL) { Status(msg); }
 
-    SetState(CONSOLE);
+    NextState(CONSOLE);
   }
-  
-  BOOL SendFile(FILE *src)
+
+  /*
+   * Reflash the readers on all ports in the port list at once.
+   * Our own port is closed while they run, since one of the jobs
+   * will want it.
+   */
+  void GangReflash()
   {
-    int i, total, read;
-    char line[1000];
-    TCHAR tmp[32];
-    
-    _tty.comm.SetTimeout(_tty.lineDelay, -1);
-    
-    for (i = 0; fgets(line, sizeof(line) - 3, src) != NULL; i++) {
-      // counting lines.
+    SRecordImage image;
+    TCHAR ports[MAXCOM][PORT_NAME];
+    const TCHAR *names[MAXCOM];
+    DWORD best[MAXCOM];
+    TCHAR tmp[MAX_PATH];
+    char line[MAX_PATH * 2];
+    Gang gang;
+    int i, count;
+
+    if (LoadImage(&image) == FALSE) {
+      NextState(CONSOLE);
+      return;
     }
-    total = i;
-    fseek(src, 0, SEEK_SET);
-    
-    for (i = 1; fgets(line, sizeof(line) - 3, src) != NULL; i++) {
-      if (_stop) { goto err; }
-      
-      sprintf_t(tmp, _countof(tmp), _T("line %d/%d"), i, total);
+
+    count = _ports.Copy(ports, MAXCOM);
+    for (i = 0; i < count; i++) {
+      names[i] = ports[i];
+      best[i] = GetBestBaud(ports[i]);
+    }
+
+    _tty.comm.Close();
+
+    if (gang.Start(names, count, &image, &_tty, _cacheDir, best) == FALSE) {
+      Status(_T("No ports to reflash"));
+      goto end;
+    }
+
+    while (gang.Wait(CONSOLE_TIMEOUT) == FALSE) {
+      if (_stop) { gang.Cancel(); }
+      gang.Summary(tmp, _countof(tmp));
       Status(tmp, 0);
-      
-      StrTrimA(line, "\r\n\t ");
-      strcat_tA(line, _countof(line), "\r\n");
-     
-      if (Port_Send(line) == FALSE) { goto err; }
-      
-      // Line delay + get whatever feedback from reader.
-      //
-      while (_stop == FALSE) {
-        read = _tty.comm.Read(line, sizeof(line) - 1);
-        if (read == 0) { break; }
-        if (read < 0) { goto err; }
-        
-        ctlOutput.ShowOutput(line, read); 
-        if (StrStrA(line, "?") != NULL) { goto err; }
-      }
     }
-    
-    return TRUE;
-    
-err:
-    Port_Send("\r\n\r\n");
-    return FALSE;
-  }
 
-#define MACRO_HEADER "# Reader Config macro file"
+    strcpy_tA(line, _countof(line), "\n");
+    Output(line, -1);
+    for (i = 0; i < count; i++) {
+      gang.Report(i, line, _countof(line));
+      Output(line, -1);
+    }
 
-  void PlayMacro()
-  {
-    TCHAR *msg = NULL;
-    FILE *f = NULL;
-    char line[1000];
-    
-    Status(_T("Playing command file..."), 0);
+    gang.Learned(&_tty);
+    for (i = 0; i < count; i++) {
+      if (gang._jobs[i]._done) { SetBestBaud(ports[i], gang._jobs[i]._tty.bestBaud); }
+    }
+    if (_logFile[0] != '\0') { gang.Log(_logFile); }
+    gang.Summary(tmp, _countof(tmp));
+    Status(tmp, _stop || (gang.Failed() > 0));
+
+end:
+    Port_Connect();
+    NextState(CONSOLE);
+  }
 
-    if (_macroName[0] == '\0') {
-      msg = _T("No command file");
+  /*
+   * Every port in the list through each stage in turn: find the
+   * reader, reflash it, verify it, play the last command file, and
+   * restart it if there is a reboot command.  _batchJobs ports go at
+   * once.  A batch that was cut short with the same image and command
+   * file is finished instead.
+   */
+  void Batch()
+  {
+    SRecordImage image;
+    TCHAR ports[MAXCOM][PORT_NAME];
+    const TCHAR *names[MAXCOM];
+    TCHAR queueName[MAX_PATH], tmp[MAX_PATH];
+    char line[MAX_PATH * 2];
+    BatchQueue batch;
+    DWORD best[BATCH_PORTS];
+    int i, count, stages;
+
+    if (GetAppDir(_T("Batch"), queueName) == FALSE) {
+      Status(_T("Cannot keep batch queue"));
       goto end;
     }
-    f = _tfopen(_macroName, _T("r"));
-    if (f == NULL) { 
-      msg = _T("Cannot open command file");
-      goto end;
+    PathAppend(queueName, _T("queue.txt"));
+
+    if (batch.Load(queueName) && lstrcmpi(batch._imageName, _job.image) == 0
+        && lstrcmpi(batch._macroName, _job.macro) == 0) {
+      sprintf_t(tmp, _countof(tmp), _T("Finishing last batch: %d readers..."), batch._count);
+      Status(tmp, 0);
+    } else {
+      count = _ports.Copy(ports, MAXCOM);
+      for (i = 0; i < count; i++) { names[i] = ports[i]; }
+
+      stages = STAGE_ALL;
+      if (_tty.verify == FALSE) { stages &= ~(1 << STAGE_VERIFY); }
+      if (batch.Create(queueName, names, count, stages, _job.image, _job.macro,
+          _reboot, _macroUnit) == FALSE) {
+        Status(_T("No ports to run"));
+        goto end;
+      }
     }
 
-/*    line[0] = '\0';
-    fgets(line, sizeof(line), f);
-    StrTrimA(line, "\r\n\t ");
-    if (strcmp(line, MACRO_HEADER) != 0) {
-      TCHAR *tmp = TmpStr();
-      PathCanonicalize(tmp, _macroName);
-      PathStripPath(tmp);
-      strcat_t(tmp, TMPSTR_MAX, _T(": not a macro file"));
-      msg = tmp;
-      goto end;
-    } */
+    if (batch._imageName[0] != '\0' && LoadImage(&image, batch._imageName) == FALSE) { goto end; }
 
-    Port_Send("\r\r\r");
-    if (Port_Expect("CMD>") == FALSE) {
-      msg = _T("No Reader detected");
-      goto end;
+    _tty.comm.Close();
+
+    // Load() and Create() hold no more than BATCH_PORTS.
+    for (i = 0; i < batch._count; i++) { best[i] = GetBestBaud(batch._jobs[i]._port); }
+
+    batch._maxJobs = _batchJobs;
+    batch.Start(&image, &_tty, _cacheDir, &_vars, best);
+    while (batch.Wait(CONSOLE_TIMEOUT) == FALSE) {
+      if (_stop) { batch.Cancel(); }
+      batch.Summary(tmp, _countof(tmp));
+      Status(tmp, 0);
     }
 
-    while (fgets(line, sizeof(line) - 2, f) != NULL) {
-      StrTrimA(line, "\r\n\t ");
-      strcat_tA(line, _countof(line), "\r");
-      if (line[0] == '#') { 
-          ctlOutput.ShowOutput(line, -1);
-          strcpy_tA(line, _countof(line), "\nCMD>");
-          ctlOutput.ShowOutput(line, -1);
-          continue;
+    strcpy_tA(line, _countof(line), "\n");
+    Output(line, -1);
+    for (i = 0; i < batch._count; i++) {
+      batch.Report(i, line, _countof(line));
+      Output(line, -1);
+      if (batch._jobs[i]._started) {
+        SetBestBaud(batch._jobs[i]._port, batch._jobs[i]._tty.bestBaud);
       }
-      Port_Send(line);
-      if (Port_Expect("CMD>") == FALSE) {
-        msg = _T("Command file cancelled");
-        goto end;
+      if (batch._jobs[i]._passed & (1 << STAGE_MACRO)) {
+        _macroUnit = max(_macroUnit, batch._jobs[i]._unit + 1);
       }
     }
 
-    Status(_T("Command file done"), 0);
+    if (_logFile[0] != '\0') { batch.Log(_logFile); }
+    batch.Finish();
+    batch.Summary(tmp, _countof(tmp));
+    Status(tmp, _stop || (batch.Failed() > 0));
 
 end:
-    if (f != NULL) { fclose(f); }
-    if (msg != NULL) { Status(msg); }
-    SetState(CONSOLE);
+    Port_Connect();
+    NextState(CONSOLE);
+  }
+
+  /*
+   * Each unit that takes the command file moves $unit on, so a .csv
+   * in it works down the rows one reader at a time.
+   */
+  void PlayMacro()
+  {
+    _vars.SetInt("unit", _macroUnit);
+    if (Reader::PlayMacro(_job.macro)) { _macroUnit++; }
+    NextState(CONSOLE);
   }
   
 
 // These should only be called from within the thread.
 
  /*
-  * Open serial port specified by the dialog.
+  * Open serial port the dialog had picked when it posted the command.
   */
   BOOL Port_Connect()
   {
-    TCHAR name[16];
+    const TCHAR *name = _job.port;
     TCHAR tmp[MAX_PATH];
     
     _tty.comm.Close();
-    Sleep(500);
+    _tty.comm.Pause(500);
     
-    sprintf_t(tmp, _countof(tmp), _T("%s: disconnected"), title);
-    SetWindowText(_hwnd, tmp);
+    PostEvent(MSG_TITLE);
 
-    ComboBox_GetText(ctlPortName, name, _countof(name));
-    if (_tty.comm.Open(name) == FALSE) {
+    if (Port_Open(name) == FALSE) {
       DWORD err = GetLastError();
       if (err == ERROR_ACCESS_DENIED) {
         sprintf_t(tmp, _countof(tmp), _T("Another program is using %s"), name);
@@ -1320,86 +2090,15 @@ end:
         FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, err, 0, tmp, _countof(tmp), NULL);
       }
       Status(tmp);
-      UpdateControls();
+      PostEvent(MSG_CONTROLS, FALSE);
+      SetLastError(err);
       return FALSE;
     }
 
-    sprintf_t(tmp, _countof(tmp), _T("%s: %s"), title, name);
-    SetWindowText(_hwnd, tmp);
-    
-    SetupComm(_tty.comm, 8192, 2048);
-    
-    DCB dcb = {0};
-    dcb.DCBlength = sizeof(dcb);
-    GetCommState(_tty.comm, &dcb);
-    
-    dcb.ByteSize = 8;
-    dcb.BaudRate = 115200;
-    dcb.Parity = NOPARITY;
-    dcb.StopBits = ONESTOPBIT;
-    
-    dcb.fParity = TRUE;
-    dcb.fBinary = TRUE;
-    
-    dcb.fDtrControl = DTR_CONTROL_ENABLE;
-    dcb.fRtsControl = RTS_CONTROL_ENABLE;
-    dcb.fOutxCtsFlow = FALSE;
-    dcb.fOutxDsrFlow = FALSE;
-    dcb.fDsrSensitivity = FALSE;
-    
-
-    // Flow control XON/XOFF
-    dcb.fOutX = TRUE;
-    dcb.fInX = TRUE;
-    dcb.XonLim = 0;
-    dcb.XoffLim = 0;
-    dcb.XonChar = CTRL('Q');
-    dcb.XoffChar = CTRL('S');
-    
-    SetCommState(_tty.comm, &dcb);
-    EscapeCommFunction(_tty.comm, SETDTR);
-    EscapeCommFunction(_tty.comm, SETRTS);
-    
-    UpdateControls();
-    SetFocus(ctlOutput);
+    PostEvent(MSG_TITLE, 0, name);
+    PostEvent(MSG_CONTROLS, TRUE);
     return TRUE;
   }
-  
-  BOOL Port_Send(const char *buf, int len = -1)
-  {
-    if (_stop) { return FALSE; }
-    if (len < 0) { len = lstrlenA(buf); }
-    
-    return _tty.comm.Write(buf, len);
-  }
-  
-#define MAX_EXPECT			1000
-  
-  /*
-  * Read up to MAX_EXPECT characters, waiting for:
-  * 1. the expected pattern to appear.
-  * 2. a timeout.
-  */
-  BOOL Port_Expect(const char *pat)
-  {
-    char tmp[MAX_EXPECT];
-    size_t len;
-    int read;
-
-    _tty.comm.SetTimeout(CMD_TIMEOUT, CMD_TIMEOUT);
-    
-    for (len = 0; len < _countof(tmp) - 1; ) {
-      read = _tty.comm.Read(tmp + len, _countof(tmp) - 1 - len);
-      if (_stop) { break; }
-      if (read <= 0) { break; }
-      ctlOutput.ShowOutput(tmp + len, read);
-      
-      len += read;
-      if (StrStrA(tmp, pat) != NULL) { return TRUE; }
-    }
-    return FALSE;
-  }
-  
 };
 
 int APIENTRY 
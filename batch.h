@@ -0,0 +1,494 @@
+#if !defined(_BATCH_H)
+#define _BATCH_H
+
+/*
+ * batch.h --
+ *
+ * Batch of readers, one per port, each taken through the same stages
+ * back to back on its own thread: find the reader, reflash it, check
+ * it against the image, play a command file, restart it.  At most
+ * _maxJobs ports run at once; the rest wait their turn.
+ *
+ * The queue is written out to a file as each stage finishes, so if the
+ * program dies or is cancelled part way the batch can be loaded again
+ * and carries on with what each port had left to do.  A port that
+ * failed a stage has run to an end and is not tried again.  Once no
+ * port is left part way, the file goes.  The owner polls Wait() and
+ * shows Summary() or Report() as it likes, as for a Gang.
+ */
+
+enum {
+  STAGE_DETECT,
+  STAGE_REFLASH,
+  STAGE_VERIFY,
+  STAGE_MACRO,
+  STAGE_REBOOT,
+  STAGES
+};
+
+#define STAGE_ALL		((1 << STAGES) - 1)
+#define BATCH_JOBS		4	/* Ports at once, by default. */
+#define BATCH_PORTS		256
+#define BATCH_TRIES		3	/* Knocks before a port has no reader. */
+#define REBOOT_TIMEOUT		10000
+
+static const char *stageNames[STAGES] = { "detect", "reflash", "verify", "macro", "reboot" };
+
+struct BatchQueue;
+
+struct BatchJob : public GangJob
+{
+  BatchQueue *_queue;
+  int _stages;		/* 1 << STAGE_xxx for each to run. */
+  int _passed;		/* ... for each of those finished. */
+  int _unit;		/* $unit for the command file. */
+  BOOL _failed;		/* A stage failed, rather than being cut short. */
+  BOOL _verified;	/* Reflash() checked the whole image this run. */
+  volatile BOOL _started;
+
+  BatchJob() : _queue(NULL), _stages(0), _passed(0), _unit(1), _failed(FALSE),
+      _verified(FALSE), _started(FALSE) {}
+
+  static DWORD CALLBACK BatchThread(LPVOID param)
+  {
+    ((BatchJob *) param)->Run();
+    return 0;
+  }
+
+  void Run();
+  BOOL Stage(int stage);
+
+  int Left() const
+  {
+    return _stages & ~_passed;
+  }
+};
+
+struct BatchQueue
+{
+  BatchJob *_jobs;
+  int _count;
+  int _maxJobs;
+  const SRecordImage *_image;
+  CRITICAL_SECTION _lock;	// Guards the queue file.
+
+  TCHAR _fileName[MAX_PATH];	/* Queue file, or "" not to keep one. */
+  TCHAR _imageName[MAX_PATH];
+  TCHAR _macroName[MAX_PATH];
+  char _reboot[32];		/* Command that restarts a reader. */
+
+  BatchQueue()
+  {
+    _jobs = NULL;
+    _count = 0;
+    _maxJobs = BATCH_JOBS;
+    _image = NULL;
+    _fileName[0] = _imageName[0] = _macroName[0] = '\0';
+    _reboot[0] = '\0';
+    InitializeCriticalSection(&_lock);
+  }
+
+  ~BatchQueue()
+  {
+    Cancel();
+    delete [] _jobs;
+    DeleteCriticalSection(&_lock);
+  }
+
+  /*
+   * New batch: stages on each of the ports, numbering units from unit.
+   * Stages with nothing to do them with are left out.  The queue file
+   * is written at once.
+   */
+  BOOL Create(const TCHAR *fileName, const TCHAR **ports, int count, int stages,
+      const TCHAR *imageName, const TCHAR *macroName, const char *reboot, int unit)
+  {
+    int i;
+
+    if (count <= 0) { return FALSE; }
+    count = min(count, BATCH_PORTS);
+
+    strcpy_t(_fileName, _countof(_fileName), fileName);
+    strcpy_t(_imageName, _countof(_imageName), imageName);
+    strcpy_t(_macroName, _countof(_macroName), macroName);
+    strcpy_tA(_reboot, _countof(_reboot), reboot);
+
+    if (_imageName[0] == '\0') { stages &= ~((1 << STAGE_REFLASH) | (1 << STAGE_VERIFY)); }
+    if (_macroName[0] == '\0') { stages &= ~(1 << STAGE_MACRO); }
+    if (_reboot[0] == '\0') { stages &= ~(1 << STAGE_REBOOT); }
+
+    delete [] _jobs;
+    _jobs = new BatchJob[count];
+    _count = count;
+    for (i = 0; i < count; i++) {
+      strcpy_t(_jobs[i]._port, _countof(_jobs[i]._port), ports[i]);
+      _jobs[i]._stages = stages;
+      _jobs[i]._unit = unit + i;
+    }
+    Save();
+    return TRUE;
+  }
+
+  /*
+   * Pick up a batch from its queue file.  Ports that got through every
+   * stage, or failed one, are left out.  Returns FALSE if there is no
+   * batch to finish.
+   */
+  BOOL Load(const TCHAR *fileName)
+  {
+    char line[MAX_PATH + 40], port[64];
+    BatchJob *job;
+    FILE *f;
+    int stages, passed, unit, failed, n;
+
+    f = _tfopen(fileName, _T("r"));
+    if (f == NULL) { return FALSE; }
+    strcpy_t(_fileName, _countof(_fileName), fileName);
+
+    for (n = 0; fgets(line, sizeof(line), f) != NULL; ) {
+      if (strncmp(line, "job ", 4) == 0) { n++; }
+    }
+    n = min(n, BATCH_PORTS);
+    delete [] _jobs;
+    _jobs = new BatchJob[n];
+    _count = 0;
+
+    rewind(f);
+    while (fgets(line, sizeof(line), f) != NULL) {
+      StrTrimA(line, "\r\n");
+      if (strncmp(line, "image ", 6) == 0) {
+        sprintf_t(_imageName, _countof(_imageName), _T("%") PRI_AS, line + 6);
+      } else if (strncmp(line, "macro ", 6) == 0) {
+        sprintf_t(_macroName, _countof(_macroName), _T("%") PRI_AS, line + 6);
+      } else if (strncmp(line, "reboot ", 7) == 0) {
+        strcpy_tA(_reboot, _countof(_reboot), line + 7);
+      } else if (sscanf(line, "job %x %x %d %d %63s", &stages, &passed, &unit, &failed, port) == 5
+          && (stages & ~passed) != 0 && failed == 0 && _count < n) {
+        job = &_jobs[_count++];
+        sprintf_t(job->_port, _countof(job->_port), _T("%") PRI_AS, port);
+        job->_stages = stages;
+        job->_passed = passed;
+        job->_unit = unit;
+      }
+    }
+    fclose(f);
+
+    return (_count > 0);
+  }
+
+  /*
+   * Write the queue out, to a new file first so a crash part way
+   * leaves the old one.
+   */
+  BOOL Save()
+  {
+    TCHAR tmp[MAX_PATH + 4];
+    FILE *f;
+    BOOL ok;
+    int i;
+
+    if (_fileName[0] == '\0') { return TRUE; }
+
+    EnterCriticalSection(&_lock);
+    sprintf_t(tmp, _countof(tmp), _T("%s.new"), _fileName);
+    f = _tfopen(tmp, _T("w"));
+    ok = (f != NULL);
+    if (ok) {
+      fprintf(f, "image %" PRI_TS "\nmacro %" PRI_TS "\nreboot %s\n",
+          _imageName, _macroName, _reboot);
+      for (i = 0; i < _count; i++) {
+        fprintf(f, "job %x %x %d %d %" PRI_TS "\n", _jobs[i]._stages, _jobs[i]._passed,
+            _jobs[i]._unit, _jobs[i]._failed, _jobs[i]._port);
+      }
+      ok = (fclose(f) == 0) && MoveFileEx(tmp, _fileName, MOVEFILE_REPLACE_EXISTING);
+    }
+    LeaveCriticalSection(&_lock);
+    return ok;
+  }
+
+  /*
+   * Start running the batch.  Each job takes the owner's settings and
+   * command file variables.  image must stay loaded until Wait() says
+   * all are done.  bestBaud, if given, is TTY::bestBaud for each job, as
+   * for Gang::Start().
+   */
+  void Start(const SRecordImage *image, const TTY *settings, const TCHAR *cacheDir,
+      const MacroVars *vars, const DWORD *bestBaud = NULL)
+  {
+    int i;
+
+    _image = image;
+    for (i = 0; i < _count; i++) {
+      BatchJob *job = &_jobs[i];
+
+      job->_queue = this;
+      job->_image = image;
+      job->Configure(settings, cacheDir, (bestBaud != NULL) ? bestBaud[i] : 0);
+      job->_vars = *vars;
+    }
+    Schedule();
+  }
+
+  /*
+   * Start waiting jobs while there are fewer than _maxJobs running.
+   */
+  void Schedule()
+  {
+    int i, running = 0;
+
+    for (i = 0; i < _count; i++) {
+      if (_jobs[i]._started && !_jobs[i]._done) { running++; }
+    }
+    for (i = 0; i < _count && running < _maxJobs; i++) {
+      BatchJob *job = &_jobs[i];
+
+      if (job->_started) { continue; }
+      job->_started = TRUE;
+      if (job->_stop) {
+        job->Status(_T("Cancelled"));
+        job->_done = TRUE;
+        continue;
+      }
+      job->_thread = CreateThread(NULL, 0, BatchJob::BatchThread, job, 0, NULL);
+      if (job->_thread == NULL) {
+        job->Status(_T("Cannot start thread"));
+        job->_done = TRUE;
+        continue;
+      }
+      running++;
+    }
+  }
+
+  void Cancel()
+  {
+    int i;
+
+    for (i = 0; i < _count; i++) { _jobs[i].Stop(); }
+  }
+
+  /*
+   * Wait up to timeout ms for all jobs to finish, starting more as
+   * others do.  Returns TRUE if they have.
+   */
+  BOOL Wait(DWORD timeout)
+  {
+    DWORD start = GetTickCount();
+    int i;
+
+    while (1) {
+      Schedule();
+      for (i = 0; i < _count; i++) {
+        if (_jobs[i]._done == FALSE) { break; }
+      }
+      if (i == _count) { return TRUE; }
+      if (GetTickCount() - start >= timeout) { return FALSE; }
+      Sleep(IDLE_TIMEOUT);
+    }
+  }
+
+  /*
+   * Once all are done: a batch with no port left part way, whether it
+   * passed or failed, has no more need of its queue file.
+   */
+  void Finish()
+  {
+    int i;
+
+    for (i = 0; i < _count; i++) {
+      if (_jobs[i].Left() != 0 && _jobs[i]._failed == FALSE) { return; }
+    }
+    if (_fileName[0] != '\0') { DeleteFile(_fileName); }
+  }
+
+  int Failed()
+  {
+    int i, failed = 0;
+
+    for (i = 0; i < _count; i++) {
+      if (_jobs[i]._done && !_jobs[i]._ok) { failed++; }
+    }
+    return failed;
+  }
+
+  void Log(const TCHAR *fileName)
+  {
+    int i;
+
+    for (i = 0; i < _count; i++) {
+      if (_jobs[i]._passed & (1 << STAGE_REFLASH)) {
+        _jobs[i]._stats.Log(fileName, _jobs[i]._port, _jobs[i]._ok);
+      }
+    }
+  }
+
+  /*
+   * e.g. "8 readers: 5 done, 1 failed, 2 running, 0 waiting"
+   */
+  void Summary(TCHAR *buf, int len)
+  {
+    int i, done, failed, running;
+
+    done = failed = running = 0;
+    for (i = 0; i < _count; i++) {
+      BatchJob *job = &_jobs[i];
+      if (job->_done) {
+        if (job->_ok) { done++; } else { failed++; }
+      } else if (job->_started) {
+        running++;
+      }
+    }
+    sprintf_t(buf, len, _T("%d readers: %d done, %d failed, %d running, %d waiting"),
+        _count, done, failed, running, _count - done - failed - running);
+  }
+
+  /*
+   * One line per port: which unit, how it ended and what it had left.
+   */
+  void Report(int i, char *buf, int len)
+  {
+    BatchJob *job = &_jobs[i];
+    TCHAR status[128];
+    char left[64];
+    int s;
+
+    left[0] = '\0';
+    for (s = 0; s < STAGES; s++) {
+      if ((job->Left() & (1 << s)) == 0) { continue; }
+      strcat_tA(left, _countof(left), (left[0] == '\0') ? ", left: " : ",");
+      strcat_tA(left, _countof(left), stageNames[s]);
+    }
+
+    job->GetStatus(status, _countof(status));
+    StringCchPrintfA(buf, len, "%" PRI_TS ": unit %d, %" PRI_TS ", %d.%d s%s%s%s\n",
+        job->_port, job->_unit, status,
+        (int) (job->_elapsed / 1000), (int) (job->_elapsed / 100) % 10, left,
+        (job->_ok || job->_last[0] == '\0') ? "" : ", last: ",
+        job->_ok ? "" : job->_last);
+  }
+
+  /*
+   * "detect,reflash,..." to 1 << STAGE_xxx for each, or -1 if one
+   * is not a stage.
+   */
+  static int Stages(const char *list)
+  {
+    int s, len, stages = 0;
+
+    while (*list != '\0') {
+      len = (int) strcspn(list, ",");
+      for (s = 0; s < STAGES; s++) {
+        if ((int) strlen(stageNames[s]) == len && strncmp(stageNames[s], list, len) == 0) { break; }
+      }
+      if (s == STAGES) { return -1; }
+      stages |= 1 << s;
+      list += len;
+      if (*list == ',') { list++; }
+    }
+    return stages;
+  }
+};
+
+/*
+ * Run the stages this port has left, in order, stopping at the first
+ * that fails.  The queue is saved after each one, and after a failure.
+ */
+inline void BatchJob::Run()
+{
+  int stage;
+
+  _start = GetTickCount();
+
+  if (Port_Open(_port) == FALSE) {
+    Status(_T("Cannot open port"));
+    _failed = !_stop;
+  } else {
+    for (stage = 0; stage < STAGES; stage++) {
+      if ((Left() & (1 << stage)) == 0) { continue; }
+      if (Stage(stage) == FALSE) {
+        _failed = !_stop;
+        break;
+      }
+      _passed |= 1 << stage;
+      _queue->Save();
+    }
+    _ok = (Left() == 0);
+    _tty.comm.Close();
+  }
+  if (_failed) { _queue->Save(); }
+
+  _elapsed = GetTickCount() - _start;
+  _done = TRUE;
+}
+
+inline BOOL BatchJob::Stage(int stage)
+{
+  static const char *prompts[] = { "Boot>", "CMD>" };
+  TCHAR err[64];
+  char cmd[40];
+  DWORD bad, start;
+  int i, found;
+
+  switch (stage) {
+  case STAGE_DETECT:
+    Status(_T("Looking for reader..."), 0);
+    for (i = 0, found = -1; (i < BATCH_TRIES) && (found < 0) && (_stop == FALSE); i++) {
+      Port_Send("\r");
+      found = Port_ExpectAny(prompts, _countof(prompts));
+    }
+    if (found < 0) {
+      Status(_stop ? _T("Cancelled") : _T("No reader found"));
+      return FALSE;
+    }
+    return TRUE;
+
+  case STAGE_REFLASH:
+    if (Reflash(_image) == FALSE) { return FALSE; }
+    _verified = _tty.verify;
+    return TRUE;
+
+  case STAGE_VERIFY:
+    // Reflash() has just made the same check.
+    if (_verified) { return TRUE; }
+
+    Status(_T("Verifying..."), 0);
+    Port_Send("\r\r\r");
+    if (Port_Expect("CMD>") == FALSE) {
+      Status(_stop ? _T("Cancelled") : _T("No Reader detected"));
+      return FALSE;
+    }
+    found = Verify(_image, &bad);
+    if (_stop) {
+      Status(_T("Cancelled"));
+      return FALSE;
+    }
+    if (found == VERIFY_FAILED) {
+      sprintf_t(err, _countof(err), _T("Reader failed verify at %X"), (unsigned) bad);
+      Status(err);
+      return FALSE;
+    }
+    Status((found == VERIFY_OK) ? _T("Verified") : _T("Reader cannot verify"), 0);
+    return TRUE;
+
+  case STAGE_MACRO:
+    _vars.SetInt("unit", _unit);
+    return PlayMacro(_queue->_macroName);
+
+  case STAGE_REBOOT:
+    Status(_T("Restarting reader..."), 0);
+    Port_Drain(LINE_TIMEOUT);
+    StringCchPrintfA(cmd, _countof(cmd), "%s\r", _queue->_reboot);
+    Port_Send(cmd);
+    for (start = GetTickCount(); GetTickCount() - start < REBOOT_TIMEOUT; ) {
+      if (Port_Expect("CMD>")) {
+        Status(_T("Reader restarted"), 0);
+        return TRUE;
+      }
+      if (_stop) { break; }
+    }
+    Status(_stop ? _T("Cancelled") : _T("Reader did not come back"));
+    return FALSE;
+  }
+  return FALSE;
+}
+
+#endif
@@ -0,0 +1,340 @@
+/*
+* bench.cpp --
+*
+* Reflash throughput benchmark.  Starts readersim on a pty and reflashes
+* it over every combination of image size, record size, line delay and
+* window asked for, timing each run from the Reader's own hooks:
+*
+*   bench --sim ./readersim --sizes 4096,65536 --records 16,32
+*         --delays 5,20 --windows 1,4 [--runs 3] [--baud N] [--flash-ms MS]
+*
+* The report is JSON on stdout, one result per run.  ttfbMs is the time
+* from the start of Reflash() to the first record going out, sendMs from
+* there to the end.  Line latency is from the write of a record
+* returning, so not counting any wait for room to write it, to the
+* "\r\n" that acknowledges it.  The line delay is fixed unless --adaptive.
+*
+* One simulator serves the whole matrix, so every run sends the whole
+* image at --baud: no skipping a reader that already has it, no verify
+* and no faster link.  A run in which no record went out fails.
+*
+* Images are made up from --seed, so the same arguments give the same
+* images and, against the simulator, much the same numbers.
+*
+* Linux:   g++ -O2 -o bench bench.cpp -lpthread
+*/
+
+#include "compat.h"
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#include "comm.h"
+#include "srecord.h"
+#include "stats.h"
+#include "macro.h"
+#include "reader.h"
+
+#define BENCH_MAX       16      /* Values per matrix axis. */
+#define BENCH_LINK      "/tmp/readersim.bench"
+
+static double
+Now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Reader that notes when each record goes out and when it is
+ * acknowledged.  SendFile() calls Progress() as soon as each record
+ * has been written.
+ */
+struct BenchReader : public Reader
+{
+  double *_sent;        /* Send time of each record, by line. */
+  double *_latency;     /* Send to acknowledge, by line. */
+  int _total, _acked;
+  double _first;        /* First record sent, or 0. */
+
+  BenchReader() : _sent(NULL), _latency(NULL), _total(0), _acked(0), _first(0) {}
+
+  ~BenchReader()
+  {
+    delete [] _sent;
+    delete [] _latency;
+  }
+
+  void Reset(int total)
+  {
+    delete [] _sent;
+    delete [] _latency;
+    _sent = new double[total];
+    _latency = new double[total];
+    _total = total;
+    _acked = 0;
+    _first = 0;
+  }
+
+  virtual void Progress(int line, int total)
+  {
+    if (line < 1 || line > _total) { return; }
+    _sent[line - 1] = Now();
+    if (line == 1) { _first = _sent[0]; }
+  }
+
+  virtual void Output(char *buf, int len)
+  {
+    double now = Now();
+    int i;
+
+    if (_first == 0) { return; }
+    for (i = 0; i < len && _acked < _total; i++) {
+      if (buf[i] == '\n') {
+        _latency[_acked] = now - _sent[_acked];
+        _acked++;
+      }
+    }
+  }
+};
+
+/*
+ * Parse "a,b,c" into vals.  Returns how many.
+ */
+static int
+ParseList(const char *src, int *vals)
+{
+  int n = 0;
+
+  while (*src != '\0' && n < BENCH_MAX) {
+    vals[n++] = atoi(src);
+    while (*src != '\0' && *src != ',') { src++; }
+    if (*src == ',') { src++; }
+  }
+  return n;
+}
+
+/*
+ * Write an S19 image of size data bytes in records of recordSize bytes.
+ */
+static BOOL
+MakeImage(const char *fileName, int size, int recordSize, unsigned seed)
+{
+  FILE *f;
+  DWORD addr;
+  int i, n, sum;
+  byte b;
+
+  f = fopen(fileName, "w");
+  if (f == NULL) { return FALSE; }
+
+  fprintf(f, "S0030000FC\n");
+  for (addr = 0; addr < (DWORD) size; addr += n) {
+    n = min(recordSize, size - (int) addr);
+    sum = n + 3 + (int) ((addr >> 8) & 0xff) + (int) (addr & 0xff);
+    fprintf(f, "S1%02X%04X", n + 3, (unsigned) (addr & 0xffff));
+    for (i = 0; i < n; i++) {
+      seed = seed * 1103515245 + 12345;
+      b = (byte) (seed >> 16);
+      sum += b;
+      fprintf(f, "%02X", b);
+    }
+    fprintf(f, "%02X\n", ~sum & 0xff);
+  }
+  fprintf(f, "S9030000FC\n");
+
+  return fclose(f) == 0;
+}
+
+static int
+CompareDouble(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+static double
+Percentile(const double *sorted, int count, int pct)
+{
+  if (count == 0) { return 0; }
+  return sorted[min(count - 1, count * pct / 100)];
+}
+
+static pid_t
+StartSim(const char *sim, const char *baud, const char *flashMs)
+{
+  struct stat st;
+  pid_t pid;
+  int i;
+
+  unlink(BENCH_LINK);
+
+  pid = fork();
+  if (pid == 0) {
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    execl(sim, sim, "--baud", baud, "--flash-ms", flashMs, "--link", BENCH_LINK,
+        (char *) NULL);
+    _exit(127);
+  }
+  if (pid < 0) { return -1; }
+
+  for (i = 0; i < 100; i++) {
+    if (lstat(BENCH_LINK, &st) == 0) { return pid; }
+    Sleep(20);
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  return -1;
+}
+
+static int
+Usage()
+{
+  fprintf(stderr,
+      "usage: bench [--sim PATH] [--sizes N,..] [--records N,..]\n"
+      "         [--delays MS,..] [--windows N,..] [--runs N] [--baud N]\n"
+      "         [--flash-ms MS] [--seed N] [--adaptive]\n");
+  return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *sim = "./readersim", *baud = "115200", *flashMs = "2";
+  int sizes[BENCH_MAX] = { 4096, 65536 }, nSizes = 2;
+  int records[BENCH_MAX] = { 16, 32 }, nRecords = 2;
+  int delays[BENCH_MAX] = { 5, 20 }, nDelays = 2;
+  int windows[BENCH_MAX] = { 1, 4 }, nWindows = 2;
+  int runs = 1;
+  unsigned seed = 1;
+  BOOL adaptive = FALSE, first = TRUE;
+  char imageName[] = "/tmp/benchXXXXXX";
+  int a, b, c, d, r, i, fd, count;
+  pid_t pid;
+
+  for (i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+    if (lstrcmpi(arg, "--adaptive") == 0) {
+      adaptive = TRUE;
+      continue;
+    }
+    if (val == NULL) { return Usage(); }
+    i++;
+
+    if (lstrcmpi(arg, "--sim") == 0) {
+      sim = val;
+    } else if (lstrcmpi(arg, "--sizes") == 0) {
+      nSizes = ParseList(val, sizes);
+    } else if (lstrcmpi(arg, "--records") == 0) {
+      nRecords = ParseList(val, records);
+    } else if (lstrcmpi(arg, "--delays") == 0) {
+      nDelays = ParseList(val, delays);
+    } else if (lstrcmpi(arg, "--windows") == 0) {
+      nWindows = ParseList(val, windows);
+    } else if (lstrcmpi(arg, "--runs") == 0) {
+      runs = atoi(val);
+    } else if (lstrcmpi(arg, "--baud") == 0) {
+      baud = val;
+    } else if (lstrcmpi(arg, "--flash-ms") == 0) {
+      flashMs = val;
+    } else if (lstrcmpi(arg, "--seed") == 0) {
+      seed = (unsigned) atoi(val);
+    } else {
+      return Usage();
+    }
+  }
+
+  fd = mkstemp(imageName);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  pid = StartSim(sim, baud, flashMs);
+  if (pid < 0) {
+    fprintf(stderr, "bench: cannot start %s\n", sim);
+    unlink(imageName);
+    return 1;
+  }
+
+  printf("{\n  \"baud\": %s,\n  \"flashMs\": %s,\n  \"adaptive\": %s,\n  \"results\": [",
+      baud, flashMs, adaptive ? "true" : "false");
+
+  for (a = 0; a < nSizes; a++) {
+    for (b = 0; b < nRecords; b++) {
+      SRecordImage image;
+
+      if (records[b] < 1 || records[b] > SREC_MAX_COUNT - 3) { continue; }
+      if (MakeImage(imageName, sizes[a], records[b], seed) == FALSE
+          || image.Load(imageName) == FALSE) {
+        fprintf(stderr, "bench: cannot make %d byte image\n", sizes[a]);
+        continue;
+      }
+
+      for (c = 0; c < nDelays; c++) {
+        for (d = 0; d < nWindows; d++) {
+          for (r = 0; r < runs; r++) {
+            BenchReader reader;
+            double start, end, wall, send;
+            BOOL ok;
+
+            reader._tty.lineDelay = delays[c];
+            reader._tty.window = windows[d];
+            reader._tty.adaptive = adaptive;
+            reader._tty.serial.baud = (DWORD) atoi(baud);
+            reader._tty.skip = FALSE;
+            reader._tty.verify = FALSE;
+            reader._tty.maxBaud = 0;
+            reader.Reset(image._count);
+
+            start = Now();
+            ok = reader.Port_Open(BENCH_LINK) && reader.Reflash(&image);
+            end = Now();
+            reader._tty.comm.Close();
+            if (ok && reader._first == 0) {
+              fprintf(stderr, "bench: run sent nothing\n");
+              ok = FALSE;
+            }
+
+            count = reader._acked;
+            qsort(reader._latency, count, sizeof(double), CompareDouble);
+
+            wall = end - start;
+            send = (reader._first > 0) ? end - reader._first : 0;
+
+            printf("%s\n    { \"imageBytes\": %d, \"recordSize\": %d, \"lines\": %d,"
+                " \"wireBytes\": %d, \"lineDelay\": %d, \"window\": %d, \"run\": %d,"
+                " \"ok\": %s, \"wallMs\": %.1f, \"ttfbMs\": %.1f, \"sendMs\": %.1f,"
+                " \"bytesPerSec\": %.0f, \"linesPerSec\": %.1f,"
+                " \"p50Ms\": %.2f, \"p99Ms\": %.2f }",
+                first ? "" : ",",
+                sizes[a], records[b], image._count, image._textLen,
+                delays[c], windows[d], r + 1, ok ? "true" : "false",
+                wall, (reader._first > 0) ? reader._first - start : 0, send,
+                (send > 0) ? image._textLen * 1000.0 / send : 0,
+                (send > 0) ? image._count * 1000.0 / send : 0,
+                Percentile(reader._latency, count, 50),
+                Percentile(reader._latency, count, 99));
+            fflush(stdout);
+            first = FALSE;
+          }
+        }
+      }
+    }
+  }
+
+  printf("\n  ]\n}\n");
+
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  unlink(imageName);
+  return 0;
+}
@@ -0,0 +1,192 @@
+#if !defined(_CHANNEL_H)
+#define _CHANNEL_H
+
+/*
+ * channel.h --
+ *
+ * Typed messages between a window and the thread talking to a reader,
+ * so that neither one ever calls into the other.  Commands go to the
+ * reader thread (which state to go to, with what was on screen at the
+ * time) through a Slot, since only the last one counts.  Events come
+ * back (status, progress, title, controls to update) through a Channel,
+ * written by one thread and read by the other, lock-free in the same
+ * way as Ring; those that do not fit wait in an Overflow, so neither
+ * side ever waits on the other.  Reader output bytes still go through
+ * a Ring.
+ *
+ * Nothing here needs a window, so the reader side can be driven by a
+ * test or a console program just by posting commands.  Needs ports.h.
+ */
+
+enum {
+  MSG_STATE,            /* Command: go to state, with port, image, macro. */
+  MSG_STATUS,           /* Event: text, err. */
+  MSG_PROGRESS,         /* Event: line of total. */
+  MSG_TITLE,            /* Event: port now open, or "" for none. */
+  MSG_PORT,             /* Event: port found by a scan. */
+  MSG_CONTROLS,         /* Event: port opened or closed. */
+  MSG_ENABLE,           /* Event: the job is done, UI back on. */
+  MSG_TYPES
+};
+
+#define CHANNEL_SIZE		32	/* Messages; a power of two. */
+
+struct Message
+{
+  int type;		/* MSG_xxx */
+  int state;		/* MSG_STATE; MSG_CONTROLS port open; MSG_ENABLE seq done. */
+  LONG seq;		/* MSG_STATE: numbered as posted. */
+  int line, total;
+  BOOL err;
+  TCHAR text[128];
+  TCHAR port[PORT_NAME];
+  TCHAR image[MAX_PATH];
+  TCHAR macro[MAX_PATH];
+
+  Message(int t = MSG_STATUS)
+  {
+    type = t;
+    state = line = total = 0;
+    seq = 0;
+    err = FALSE;
+    text[0] = port[0] = image[0] = macro[0] = '\0';
+  }
+};
+
+struct Channel
+{
+  Message _msgs[CHANNEL_SIZE];
+  volatile LONG _head;	/* Next to put.  Written by the sender. */
+  volatile LONG _tail;	/* Next to get.  Written by the receiver. */
+
+  Channel() : _head(0), _tail(0) {}
+
+  LONG Used()
+  {
+    return _head - _tail;
+  }
+
+  /*
+   * Sender side.  Returns FALSE if the receiver is CHANNEL_SIZE
+   * messages behind.
+   */
+  BOOL Post(const Message *msg)
+  {
+    LONG head = _head;
+
+    if (head - _tail >= CHANNEL_SIZE) { return FALSE; }
+    _msgs[head & (CHANNEL_SIZE - 1)] = *msg;
+    // Message must be in place before the receiver can see it.
+    InterlockedExchange(&_head, head + 1);
+    return TRUE;
+  }
+
+  /*
+   * Receiver side.  Returns FALSE if there is nothing waiting.
+   */
+  BOOL Get(Message *msg)
+  {
+    LONG tail = _tail;
+
+    if (_head == tail) { return FALSE; }
+    MemoryBarrier();
+    *msg = _msgs[tail & (CHANNEL_SIZE - 1)];
+    InterlockedExchange(&_tail, tail + 1);
+    return TRUE;
+  }
+};
+
+/*
+ * One command, where a newer one replaces one not yet taken.
+ */
+struct Slot
+{
+  CRITICAL_SECTION _lock;
+  Message _msg;
+  BOOL _full;
+
+  Slot() : _full(FALSE) { InitializeCriticalSection(&_lock); }
+  ~Slot() { DeleteCriticalSection(&_lock); }
+
+  void Post(const Message *msg)
+  {
+    EnterCriticalSection(&_lock);
+    _msg = *msg;
+    _full = TRUE;
+    LeaveCriticalSection(&_lock);
+  }
+
+  /*
+   * Returns FALSE if nothing has been posted since the last Get().
+   */
+  BOOL Get(Message *msg)
+  {
+    BOOL full;
+
+    EnterCriticalSection(&_lock);
+    full = _full;
+    if (full) { *msg = _msg; }
+    _full = FALSE;
+    LeaveCriticalSection(&_lock);
+    return full;
+  }
+};
+
+/*
+ * Events that did not fit in a Channel.  Each says how things are now,
+ * so only the last of each type is kept.  Once one is here, later ones
+ * come here too until the receiver has taken them all, so none gets
+ * ahead of an older one still in the Channel.
+ */
+struct Overflow
+{
+  CRITICAL_SECTION _lock;
+  Message _msgs[MSG_TYPES];
+  BOOL _has[MSG_TYPES];
+  volatile LONG _count;
+
+  Overflow() : _count(0)
+  {
+    InitializeCriticalSection(&_lock);
+    memset(_has, 0, sizeof(_has));
+  }
+  ~Overflow() { DeleteCriticalSection(&_lock); }
+
+  /*
+   * Sender side, in place of ch->Post().  Never fails.
+   */
+  void Post(Channel *ch, const Message *msg)
+  {
+    EnterCriticalSection(&_lock);
+    if (_count > 0 || ch->Post(msg) == FALSE) {
+      if (_has[msg->type] == FALSE) { _count++; }
+      _has[msg->type] = TRUE;
+      _msgs[msg->type] = *msg;
+    }
+    LeaveCriticalSection(&_lock);
+  }
+
+  /*
+   * Receiver side, once the Channel is empty.  Returns FALSE if there
+   * is nothing waiting.
+   */
+  BOOL Get(Message *msg)
+  {
+    BOOL got = FALSE;
+    int i;
+
+    EnterCriticalSection(&_lock);
+    for (i = 0; i < MSG_TYPES && got == FALSE; i++) {
+      if (_has[i]) {
+        *msg = _msgs[i];
+        _has[i] = FALSE;
+        _count--;
+        got = TRUE;
+      }
+    }
+    LeaveCriticalSection(&_lock);
+    return got;
+  }
+};
+
+#endif
@@ -0,0 +1,559 @@
+#if !defined(_COMM_H)
+#define _COMM_H
+
+/*
+ * comm.h --
+ *
+ * Serial transport.  Read() returns as soon as any bytes arrive instead
+ * of waiting out a timeout, and Cancel(), from any thread, wakes up
+ * whatever Read(), Write() or Pause() is waiting so a state change
+ * takes effect at once.
+ *
+ * Two backends with the same CommPort interface, picked at compile
+ * time: overlapped I/O on Win32, and termios with poll() on POSIX for
+ * real ttys and ptys.  Configure() covers line settings for both, so
+ * nothing above this needs an OS call to set up a port.
+ */
+
+#define CTRL(x)		        (x - 'A' + 1)
+#define HOLD_SLACK		20	/* ms output may run late before POSIX
+					   Held() takes it for XOFF. */
+
+struct SerialConfig
+{
+  DWORD baud;
+  BOOL xonxoff;		/* Software flow control, both ways. */
+  BOOL dtr, rts;	/* Raise these lines. */
+  int inBuf, outBuf;	/* Driver queue sizes, where the OS lets us. */
+};
+
+inline void DefaultSerialConfig(SerialConfig *cfg)
+{
+  cfg->baud = 115200;
+  cfg->xonxoff = TRUE;
+  cfg->dtr = TRUE;
+  cfg->rts = TRUE;
+  cfg->inBuf = 8192;
+  cfg->outBuf = 2048;
+}
+
+#if defined(_WIN32)
+
+struct CommPort
+{
+  HANDLE _h;		/* NULL when closed. */
+  HANDLE _cancel;	/* Manual reset; set by Cancel(). */
+  OVERLAPPED _rd, _wr;
+  TCHAR _name[16];
+  DWORD _timeout;	/* Read timeout, ms. */
+  BOOL _error;		/* Last Read() or Write() failed. */
+
+  CommPort()
+  {
+    _h = NULL;
+    _cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    memset(&_rd, 0, sizeof(_rd));
+    memset(&_wr, 0, sizeof(_wr));
+    _rd.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    _wr.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    _name[0] = '\0';
+    _timeout = 0;
+    _error = FALSE;
+  }
+
+  ~CommPort()
+  {
+    Close();
+    CloseHandle(_rd.hEvent);
+    CloseHandle(_wr.hEvent);
+    CloseHandle(_cancel);
+  }
+
+  BOOL IsOpen() const { return _h != NULL; }
+
+  const TCHAR *Name() const { return _name; }
+
+  BOOL Error() const { return _error; }
+
+  /*
+   * Open "COMn" or "COMn:".  On failure, GetLastError() says why.
+   */
+  BOOL Open(const TCHAR *name)
+  {
+    TCHAR path[32];
+    COMMTIMEOUTS ct = {0};
+    HANDLE h;
+    int len;
+
+    Close();
+
+    // "\\.\COMn" works for every n; "COMn:" only up to COM9.
+    sprintf_t(path, _countof(path), _T("\\\\.\\%s"), name);
+    len = lstrlen(path);
+    if (len > 0 && path[len - 1] == ':') { path[len - 1] = '\0'; }
+
+    h = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED, NULL);
+    if (h == INVALID_HANDLE_VALUE) { return FALSE; }
+
+    _h = h;
+    _error = FALSE;
+    strcpy_t(_name, _countof(_name), name);
+
+    // Reads return at once with whatever is there; Read() does the
+    // waiting on an event, so it can be cancelled.
+    ct.ReadIntervalTimeout = MAXDWORD;
+    SetCommTimeouts(_h, &ct);
+    SetCommMask(_h, EV_RXCHAR);
+    return TRUE;
+  }
+
+  void Close()
+  {
+    if (_h != NULL) {
+      CloseHandle(_h);
+      _h = NULL;
+    }
+  }
+
+  /*
+   * 8N1 at cfg->baud.  XON/XOFF is ^Q/^S.
+   */
+  BOOL Configure(const SerialConfig *cfg)
+  {
+    DCB dcb = {0};
+
+    if (_h == NULL) { return FALSE; }
+
+    SetupComm(_h, cfg->inBuf, cfg->outBuf);
+
+    dcb.DCBlength = sizeof(dcb);
+    GetCommState(_h, &dcb);
+
+    dcb.ByteSize = 8;
+    dcb.BaudRate = cfg->baud;
+    dcb.Parity = NOPARITY;
+    dcb.StopBits = ONESTOPBIT;
+
+    dcb.fParity = TRUE;
+    dcb.fBinary = TRUE;
+
+    dcb.fDtrControl = cfg->dtr ? DTR_CONTROL_ENABLE : DTR_CONTROL_DISABLE;
+    dcb.fRtsControl = cfg->rts ? RTS_CONTROL_ENABLE : RTS_CONTROL_DISABLE;
+    dcb.fOutxCtsFlow = FALSE;
+    dcb.fOutxDsrFlow = FALSE;
+    dcb.fDsrSensitivity = FALSE;
+
+    dcb.fOutX = cfg->xonxoff;
+    dcb.fInX = cfg->xonxoff;
+    dcb.XonLim = 0;
+    dcb.XoffLim = 0;
+    dcb.XonChar = CTRL('Q');
+    dcb.XoffChar = CTRL('S');
+
+    if (SetCommState(_h, &dcb) == FALSE) { return FALSE; }
+    EscapeCommFunction(_h, cfg->dtr ? SETDTR : CLRDTR);
+    EscapeCommFunction(_h, cfg->rts ? SETRTS : CLRRTS);
+    return TRUE;
+  }
+
+  /*
+   * Has the reader stopped us with XOFF?
+   */
+  BOOL Held()
+  {
+    DWORD errors;
+    COMSTAT stat = {0};
+
+    if (_h == NULL) { return FALSE; }
+    if (ClearCommError(_h, &errors, &stat) == FALSE) { return FALSE; }
+    return stat.fXoffHold;
+  }
+
+  /*
+   * How long Read() waits for the first byte.  Once any bytes are in,
+   * Read() returns them straight away.  The interval is not needed
+   * with overlapped reads and is ignored.
+   */
+  void SetTimeout(int timeout, int interval)
+  {
+    _timeout = (timeout < 0) ? 0 : timeout;
+  }
+
+  /*
+   * Wake up whoever is waiting on this port.  Stays set until Reset().
+   */
+  void Cancel()
+  {
+    SetEvent(_cancel);
+  }
+
+  void Reset()
+  {
+    ResetEvent(_cancel);
+  }
+
+  /*
+   * Wait for ms, or until cancelled.  Returns FALSE if cancelled.
+   */
+  BOOL Pause(DWORD ms)
+  {
+    return WaitForSingleObject(_cancel, ms) == WAIT_TIMEOUT;
+  }
+
+  /*
+   * Wait for an overlapped operation, or until cancelled.
+   * Returns bytes transferred, 0 on timeout or cancel, -1 on error.
+   */
+  int Complete(OVERLAPPED *ov, BOOL started, DWORD timeout)
+  {
+    HANDLE wait[2];
+    DWORD done = 0;
+
+    if (started == FALSE) {
+      if (GetLastError() != ERROR_IO_PENDING) { goto err; }
+
+      wait[0] = ov->hEvent;
+      wait[1] = _cancel;
+      if (WaitForMultipleObjects(2, wait, FALSE, timeout) != WAIT_OBJECT_0) {
+        CancelIo(_h);
+      }
+    }
+    if (GetOverlappedResult(_h, ov, &done, TRUE) == FALSE) {
+      if (GetLastError() == ERROR_OPERATION_ABORTED) { return (int) done; }
+      goto err;
+    }
+    return (int) done;
+
+err:
+    _error = TRUE;
+    return -1;
+  }
+
+  /*
+   * Read whatever has arrived, waiting up to the timeout for the first
+   * byte.  Returns bytes read, 0 on timeout or cancel, -1 on error.
+   */
+  int Read(void *buf, int len)
+  {
+    DWORD mask, got, start, elapsed, errors;
+    COMSTAT stat;
+    BOOL ok;
+    int n;
+
+    if (_h == NULL) { return -1; }
+
+    start = GetTickCount();
+    while (1) {
+      // Anything there already?
+      ResetEvent(_rd.hEvent);
+      ok = ReadFile(_h, buf, len, &got, &_rd);
+      n = Complete(&_rd, ok, INFINITE);
+      if (n != 0) { return n; }
+
+      if (WaitForSingleObject(_cancel, 0) == WAIT_OBJECT_0) { return 0; }
+      elapsed = GetTickCount() - start;
+      if (elapsed >= _timeout) { return 0; }
+
+      // No; wait for some.  Bytes that came in after the read found
+      // none raise no EV_RXCHAR, so look again once the wait is armed.
+      ResetEvent(_rd.hEvent);
+      ok = WaitCommEvent(_h, &mask, &_rd);
+      if (ok == FALSE && GetLastError() == ERROR_IO_PENDING) {
+        if (ClearCommError(_h, &errors, &stat) && stat.cbInQue > 0) {
+          CancelIo(_h);
+          GetOverlappedResult(_h, &_rd, &got, TRUE);
+          continue;
+        }
+        SetLastError(ERROR_IO_PENDING);
+      }
+      if (Complete(&_rd, ok, _timeout - elapsed) < 0) { return -1; }
+    }
+  }
+
+  /*
+   * Write all of buf.  Blocks while the reader holds us off with XOFF,
+   * but not past a Cancel().  There is one _wr, so only one thread may
+   * write.
+   */
+  BOOL Write(const void *buf, int len)
+  {
+    DWORD done;
+    BOOL ok;
+
+    if (_h == NULL) { return FALSE; }
+
+    ResetEvent(_wr.hEvent);
+    ok = WriteFile(_h, buf, len, &done, &_wr);
+    return Complete(&_wr, ok, INFINITE) == len;
+  }
+};
+
+#else
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+struct CommPort
+{
+  int _fd;		/* -1 when closed. */
+  int _cancel[2];	/* Pipe; readable while cancelled. */
+  volatile LONG _cancelled;
+  TCHAR _name[64];
+  DWORD _timeout;	/* Read timeout, ms. */
+  BOOL _error;		/* Last Read() or Write() failed. */
+  DWORD _baud;		/* As configured, for Held(). */
+  DWORD _drainBy;	/* Tick by which all written should be out. */
+  BOOL _waited;		/* Last Write() had to wait for room. */
+
+  CommPort()
+  {
+    _fd = -1;
+    _baud = 0;
+    _drainBy = 0;
+    _waited = FALSE;
+    if (pipe(_cancel) == 0) {
+      fcntl(_cancel[0], F_SETFL, O_NONBLOCK);
+      fcntl(_cancel[1], F_SETFL, O_NONBLOCK);
+    } else {
+      _cancel[0] = _cancel[1] = -1;
+    }
+    _cancelled = 0;
+    _name[0] = '\0';
+    _timeout = 0;
+    _error = FALSE;
+  }
+
+  ~CommPort()
+  {
+    Close();
+    if (_cancel[0] >= 0) { close(_cancel[0]); }
+    if (_cancel[1] >= 0) { close(_cancel[1]); }
+  }
+
+  BOOL IsOpen() const { return _fd >= 0; }
+
+  const TCHAR *Name() const { return _name; }
+
+  BOOL Error() const { return _error; }
+
+  /*
+   * Open a tty or pty by path.  On failure, GetLastError() says why.
+   */
+  BOOL Open(const TCHAR *name)
+  {
+    Close();
+
+    _fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (_fd < 0) { return FALSE; }
+
+    _error = FALSE;
+    strcpy_t(_name, _countof(_name), name);
+    return TRUE;
+  }
+
+  void Close()
+  {
+    if (_fd >= 0) {
+      close(_fd);
+      _fd = -1;
+    }
+  }
+
+  static speed_t Speed(DWORD baud)
+  {
+    switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#if defined(B460800)
+    case 460800: return B460800;
+    case 921600: return B921600;
+#endif
+    }
+    return B0;
+  }
+
+  /*
+   * 8N1 raw at cfg->baud.  XON/XOFF is ^Q/^S.  Linux has fixed size
+   * tty queues, so the buffer sizes are not used.  Modem lines are
+   * best effort, since a pty has none.
+   */
+  BOOL Configure(const SerialConfig *cfg)
+  {
+    struct termios tio;
+    speed_t speed = Speed(cfg->baud);
+    int lines = 0;
+
+    if (_fd < 0) { return FALSE; }
+    if (speed == B0) {
+      errno = EINVAL;
+      return FALSE;
+    }
+    if (tcgetattr(_fd, &tio) != 0) { return FALSE; }
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+    tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+    if (cfg->xonxoff) { tio.c_iflag |= IXON | IXOFF; }
+    tio.c_cc[VSTART] = CTRL('Q');
+    tio.c_cc[VSTOP] = CTRL('S');
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    if (tcsetattr(_fd, TCSANOW, &tio) != 0) { return FALSE; }
+
+    if (cfg->dtr) { lines |= TIOCM_DTR; }
+    if (cfg->rts) { lines |= TIOCM_RTS; }
+    ioctl(_fd, TIOCMBIS, &lines);
+    _baud = cfg->baud;
+    _drainBy = GetTickCount();
+    return TRUE;
+  }
+
+  /*
+   * termios does not say whether output is stopped by XOFF, so take it
+   * that it is if the last Write() had to wait for room (a stopped pty
+   * takes nothing), or if some is still queued well after the line
+   * rate would have sent it all (a stopped tty queues it).
+   */
+  BOOL Held()
+  {
+    int queued = 0;
+
+    if (_fd < 0) { return FALSE; }
+    if (_waited) { return TRUE; }
+    if (_baud == 0) { return FALSE; }
+    if (ioctl(_fd, TIOCOUTQ, &queued) != 0 || queued == 0) { return FALSE; }
+    return (LONG) (GetTickCount() - _drainBy) > HOLD_SLACK;
+  }
+
+  void SetTimeout(int timeout, int interval)
+  {
+    _timeout = (timeout < 0) ? 0 : timeout;
+  }
+
+  void Cancel()
+  {
+    char ch = 0;
+
+    if (InterlockedExchange(&_cancelled, 1) == 0) {
+      if (write(_cancel[1], &ch, 1) < 0) { /* Pipe full: already set. */ }
+    }
+  }
+
+  void Reset()
+  {
+    char tmp[16];
+
+    if (InterlockedExchange(&_cancelled, 0) != 0) {
+      while (read(_cancel[0], tmp, sizeof(tmp)) > 0) {}
+    }
+  }
+
+  /*
+   * Wait until fd is ready for events, or until cancelled or timed out.
+   * Returns 1 if ready, 0 on timeout or cancel, -1 on error.
+   */
+  int Wait(int fd, short events, DWORD timeout)
+  {
+    struct pollfd fds[2];
+    int n;
+
+    fds[0].fd = _cancel[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = fd;
+    fds[1].events = events;
+
+    do {
+      n = poll(fds, (fd >= 0) ? 2 : 1, (timeout == INFINITE) ? -1 : (int) timeout);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) { return -1; }
+    if (fds[0].revents != 0) { return 0; }
+    if (n == 0) { return 0; }
+    return 1;
+  }
+
+  BOOL Pause(DWORD ms)
+  {
+    return Wait(-1, 0, ms) == 0 && _cancelled == 0;
+  }
+
+  /*
+   * Read whatever has arrived, waiting up to the timeout for the first
+   * byte.  Returns bytes read, 0 on timeout or cancel, -1 on error or
+   * hangup.
+   */
+  int Read(void *buf, int len)
+  {
+    DWORD start, elapsed;
+    int n;
+
+    if (_fd < 0) { return -1; }
+
+    start = GetTickCount();
+    while (1) {
+      n = (int) read(_fd, buf, len);
+      if (n > 0) { return n; }
+      if (n == 0 || (errno != EAGAIN && errno != EINTR)) { goto err; }
+
+      if (_cancelled) { return 0; }
+      elapsed = GetTickCount() - start;
+      if (elapsed >= _timeout) { return 0; }
+
+      n = Wait(_fd, POLLIN, _timeout - elapsed);
+      if (n < 0) { goto err; }
+    }
+
+err:
+    _error = TRUE;
+    return -1;
+  }
+
+  /*
+   * Write all of buf.  Blocks while the reader holds us off with XOFF,
+   * but not past a Cancel().
+   */
+  BOOL Write(const void *buf, int len)
+  {
+    const char *src = (const char *) buf;
+    DWORD now = GetTickCount();
+    int n;
+
+    if (_fd < 0) { return FALSE; }
+
+    // Ten bits a byte, after whatever is still going out.
+    if ((LONG) (now - _drainBy) > 0) { _drainBy = now; }
+    if (_baud > 0) { _drainBy += (DWORD) (len * 10000 / _baud) + 1; }
+    _waited = FALSE;
+
+    while (len > 0) {
+      n = (int) write(_fd, src, len);
+      if (n > 0) {
+        src += n;
+        len -= n;
+        continue;
+      }
+      if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        _error = TRUE;
+        return FALSE;
+      }
+      _waited = TRUE;
+      if (Wait(_fd, POLLOUT, INFINITE) <= 0) { return FALSE; }
+    }
+    return TRUE;
+  }
+};
+
+#endif
+
+#endif
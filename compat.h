@@ -0,0 +1,230 @@
+#if !defined(_COMPAT_H)
+#define _COMPAT_H
+
+/*
+ * compat.h --
+ *
+ * Just enough of Win32 and winclass for the reader protocol headers
+ * (comm.h, srecord.h, reader.h, gang.h, probe.h) to build headless on
+ * POSIX systems, so the flashing engine can run on Linux test racks.
+ *
+ * On Windows this only adds the few macros the headers need to format
+ * TCHAR strings portably.
+ */
+
+#if defined(UNICODE)
+#define PRI_TS          "ls"    /* TCHAR string in a char format. */
+#define PRI_AS          L"hs"   /* char string in a TCHAR format. */
+#else
+#define PRI_TS          "s"
+#define PRI_AS          "s"
+#endif
+
+#if defined(_WIN32)
+
+#define PATH_SEP        _T("\\")
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PATH_SEP        "/"
+
+typedef int BOOL;
+typedef unsigned int DWORD;
+typedef long LONG;
+typedef unsigned int UINT;
+typedef unsigned char byte;
+typedef char TCHAR;
+typedef void *LPVOID;
+
+#define TRUE            1
+#define FALSE           0
+
+#define _T(x)           x
+#define CALLBACK
+#define INFINITE        0xffffffff
+#define MAX_PATH        260
+
+#define ERROR_ACCESS_DENIED     EBUSY
+#define ERROR_FILE_NOT_FOUND    ENOENT
+
+#if !defined(_countof)
+#define _countof(a)     (sizeof(a) / sizeof((a)[0]))
+#endif
+#if !defined(min)
+#define min(a, b)       (((a) < (b)) ? (a) : (b))
+#endif
+
+#define _tfopen         fopen
+#define lstrlen         strlen
+#define lstrlenA        strlen
+#define lstrcmpi        strcasecmp
+#define _ttoi           atoi
+#define _tcschr         strchr
+#define _tcsnicmp       strncasecmp
+#define _tcstol         strtol
+#define _istdigit       isdigit
+#define _totupper       toupper
+#define _vsntprintf     vsnprintf
+
+inline DWORD GetLastError() { return (DWORD) errno; }
+inline void SetLastError(DWORD err) { errno = (int) err; }
+inline BOOL DeleteFile(const TCHAR *name) { return unlink(name) == 0; }
+
+#define MOVEFILE_REPLACE_EXISTING       1
+
+inline BOOL MoveFileEx(const TCHAR *from, const TCHAR *to, DWORD)
+{
+  return rename(from, to) == 0;
+}
+
+inline DWORD GetTickCount()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (DWORD) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+inline void Sleep(DWORD ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long) (ms % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+}
+
+/*
+ * Bounded string functions from winclass.  The result is always
+ * terminated; FALSE if it had to be cut short.
+ */
+inline BOOL strcpy_t(char *dst, size_t len, const char *src)
+{
+  size_t n = (src != NULL) ? strlen(src) : 0;
+  BOOL fits = (n < len);
+
+  if (len == 0) { return FALSE; }
+  if (fits == FALSE) { n = len - 1; }
+  if (n > 0) { memcpy(dst, src, n); }
+  dst[n] = '\0';
+  return fits;
+}
+
+inline BOOL strcat_t(char *dst, size_t len, const char *src)
+{
+  size_t used = strnlen(dst, len);
+
+  if (used == len) { return FALSE; }
+  return strcpy_t(dst + used, len - used, src);
+}
+
+inline BOOL sprintf_t(char *dst, size_t len, const char *fmt, ...)
+{
+  va_list args;
+  int n;
+
+  va_start(args, fmt);
+  n = vsnprintf(dst, len, fmt, args);
+  va_end(args);
+  return (n >= 0 && (size_t) n < len);
+}
+
+/*
+ * Trim any of the characters in set from both ends of str, in place.
+ */
+inline BOOL StrTrimA(char *str, const char *set)
+{
+  size_t orig = strlen(str);
+  size_t skip = strspn(str, set);
+  size_t len = orig;
+
+  while (len > skip && strchr(set, str[len - 1]) != NULL) { len--; }
+  memmove(str, str + skip, len - skip);
+  str[len - skip] = '\0';
+  return (len - skip) != orig;
+}
+
+#define strcpy_tA       strcpy_t
+#define strcat_tA       strcat_t
+#define StringCchPrintfA sprintf_t
+
+/*
+ * Threads.  A thread HANDLE is only ever waited for once and closed.
+ */
+typedef struct CompatThread *HANDLE;
+
+struct CompatThread
+{
+  pthread_t id;
+  DWORD (*fn)(LPVOID);
+  LPVOID param;
+};
+
+inline void *CompatThreadMain(void *arg)
+{
+  CompatThread *t = (CompatThread *) arg;
+
+  t->fn(t->param);
+  return NULL;
+}
+
+inline HANDLE CreateThread(void *, size_t, DWORD (*fn)(LPVOID), LPVOID param,
+    DWORD, DWORD *)
+{
+  CompatThread *t = new CompatThread;
+
+  t->fn = fn;
+  t->param = param;
+  if (pthread_create(&t->id, NULL, CompatThreadMain, t) != 0) {
+    delete t;
+    return NULL;
+  }
+  return t;
+}
+
+inline DWORD WaitForSingleObject(HANDLE t, DWORD)
+{
+  pthread_join(t->id, NULL);
+  return 0;
+}
+
+inline BOOL CloseHandle(HANDLE t)
+{
+  delete t;
+  return TRUE;
+}
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+inline void InitializeCriticalSection(CRITICAL_SECTION *cs) { pthread_mutex_init(cs, NULL); }
+inline void DeleteCriticalSection(CRITICAL_SECTION *cs) { pthread_mutex_destroy(cs); }
+inline void EnterCriticalSection(CRITICAL_SECTION *cs) { pthread_mutex_lock(cs); }
+inline void LeaveCriticalSection(CRITICAL_SECTION *cs) { pthread_mutex_unlock(cs); }
+
+inline LONG InterlockedExchange(volatile LONG *p, LONG v)
+{
+  __sync_synchronize();
+  return __sync_lock_test_and_set(p, v);
+}
+inline LONG InterlockedIncrement(volatile LONG *p) { return __sync_add_and_fetch(p, 1); }
+inline LONG InterlockedDecrement(volatile LONG *p) { return __sync_sub_and_fetch(p, 1); }
+inline LONG InterlockedCompareExchange(volatile LONG *p, LONG x, LONG cmp)
+{
+  return __sync_val_compare_and_swap(p, cmp, x);
+}
+#define MemoryBarrier() __sync_synchronize()
+
+#endif
+
+#endif
@@ -0,0 +1,289 @@
+#if !defined(_GANG_H)
+#define _GANG_H
+
+/*
+ * gang.h --
+ *
+ * Gang reflash: program the same S-record image into readers on several
+ * serial ports at once.  Each port gets its own Reader running on its
+ * own thread, all sharing the one loaded image; the owner polls Wait()
+ * and shows Summary() or the per-port results as it likes.
+ */
+
+struct GangJob : public Reader
+{
+  TCHAR _port[64];
+  const SRecordImage *_image;
+
+  HANDLE _thread;
+  CRITICAL_SECTION _lock;     // Guards _status.
+
+  TCHAR _status[128];	/* Last status from the reader. */
+  BOOL _statusErr;
+  char _last[80];	/* Last line of output, to help explain errors. */
+  int _lastLen;
+
+  int _line, _total;
+  volatile BOOL _done, _ok;	/* Set by the job thread, _done last. */
+  DWORD _start, _elapsed;
+
+  GangJob()
+  {
+    _port[0] = '\0';
+    _image = NULL;
+    _thread = NULL;
+
+    _status[0] = '\0';
+    _statusErr = FALSE;
+    _last[0] = '\0';
+    _lastLen = 0;
+
+    _line = _total = 0;
+    _done = _ok = FALSE;
+    _start = _elapsed = 0;
+
+    InitializeCriticalSection(&_lock);
+  }
+
+  ~GangJob()
+  {
+    if (_thread != NULL) {
+      WaitForSingleObject(_thread, INFINITE);
+      CloseHandle(_thread);
+    }
+    DeleteCriticalSection(&_lock);
+  }
+
+  virtual void Output(char *buf, int len)
+  {
+    int i;
+
+    if (len < 0) { len = lstrlenA(buf); }
+
+    // Keep the last line that had anything printable in it.
+    for (i = 0; i < len; i++) {
+      byte ch = buf[i];
+      if (ch == '\r' || ch == '\n') {
+        _lastLen = 0;
+      } else if (ch >= 32 && _lastLen < (int) sizeof(_last) - 1) {
+        _last[_lastLen++] = ch;
+        _last[_lastLen] = '\0';
+      }
+    }
+  }
+
+  virtual void Status(const TCHAR *msg, BOOL err = TRUE)
+  {
+    EnterCriticalSection(&_lock);
+    strcpy_t(_status, _countof(_status), msg);
+    _statusErr = err;
+    LeaveCriticalSection(&_lock);
+  }
+
+  virtual void Progress(int line, int total)
+  {
+    _total = total;
+    _line = line;
+  }
+
+  void GetStatus(TCHAR *buf, int len)
+  {
+    EnterCriticalSection(&_lock);
+    strcpy_t(buf, len, _status);
+    LeaveCriticalSection(&_lock);
+  }
+
+  /*
+   * Take on the owner's port settings.  bestBaud is as for
+   * TTY::bestBaud.
+   */
+  void Configure(const TTY *settings, const TCHAR *cacheDir, DWORD bestBaud)
+  {
+    _tty.serial = settings->serial;
+    _tty.lineDelay = settings->lineDelay;
+    _tty.window = settings->window;
+    _tty.adaptive = settings->adaptive;
+    _tty.macroDepth = settings->macroDepth;
+    _tty.verify = settings->verify;
+    _tty.skip = settings->skip;
+    _tty.maxBaud = settings->maxBaud;
+    _tty.bestBaud = bestBaud;
+    memcpy(_tty.learned, settings->learned, sizeof(_tty.learned));
+    strcpy_t(_cacheDir, _countof(_cacheDir), cacheDir);
+  }
+
+  static DWORD CALLBACK JobThread(LPVOID param)
+  {
+    ((GangJob *) param)->Run();
+    return 0;
+  }
+
+  void Run()
+  {
+    _start = GetTickCount();
+
+    if (Port_Open(_port) == FALSE) {
+      Status(_T("Cannot open port"));
+    } else {
+      _ok = Reflash(_image);
+      _tty.comm.Close();
+    }
+
+    _elapsed = GetTickCount() - _start;
+    _done = TRUE;
+  }
+};
+
+struct Gang
+{
+  GangJob *_jobs;
+  int _count;
+
+  Gang() : _jobs(NULL), _count(0) {}
+
+  ~Gang()
+  {
+    Cancel();
+    delete [] _jobs;
+  }
+
+  /*
+   * Start reflashing image into the readers on each of the ports.
+   * Job threads run until done or cancelled; use Wait() to find out when.
+   * image must stay loaded until then.  cacheDir is as for
+   * Reader::_cacheDir.  bestBaud, if given, is TTY::bestBaud for each
+   * port; what each ends up at is left in its job's _tty.
+   */
+  BOOL Start(const TCHAR **ports, int count, const SRecordImage *image,
+      const TTY *settings, const TCHAR *cacheDir, const DWORD *bestBaud = NULL)
+  {
+    int i;
+
+    if (count <= 0) { return FALSE; }
+
+    _jobs = new GangJob[count];
+    _count = count;
+
+    for (i = 0; i < count; i++) {
+      GangJob *job = &_jobs[i];
+
+      strcpy_t(job->_port, _countof(job->_port), ports[i]);
+      job->_image = image;
+      job->Configure(settings, cacheDir, (bestBaud != NULL) ? bestBaud[i] : 0);
+      job->_thread = CreateThread(NULL, 0, GangJob::JobThread, job, 0, NULL);
+      if (job->_thread == NULL) {
+        job->Status(_T("Cannot start thread"));
+        job->_done = TRUE;
+      }
+    }
+    return TRUE;
+  }
+
+  void Cancel()
+  {
+    int i;
+
+    for (i = 0; i < _count; i++) { _jobs[i].Stop(); }
+  }
+
+  /*
+   * Wait up to timeout ms for all jobs to finish.
+   * Returns TRUE if they have.
+   */
+  BOOL Wait(DWORD timeout)
+  {
+    DWORD start = GetTickCount();
+    int i;
+
+    while (1) {
+      for (i = 0; i < _count; i++) {
+        if (_jobs[i]._done == FALSE) { break; }
+      }
+      if (i == _count) { return TRUE; }
+      if (GetTickCount() - start >= timeout) { return FALSE; }
+      Sleep(IDLE_TIMEOUT);
+    }
+  }
+
+  int Failed()
+  {
+    int i, failed = 0;
+
+    for (i = 0; i < _count; i++) {
+      if (_jobs[i]._done && !_jobs[i]._ok) { failed++; }
+    }
+    return failed;
+  }
+
+  /*
+   * Fold the line delays the jobs learned back into settings.  Each job
+   * tuned itself; the slowest reader of a model that got through sets
+   * where the next run starts from.
+   */
+  void Learned(TTY *settings)
+  {
+    int i, m;
+
+    for (m = 0; m < MODELS; m++) {
+      int delay = 0;
+
+      for (i = 0; i < _count; i++) {
+        if (_jobs[i]._ok && _jobs[i]._tty.learned[m] > delay) {
+          delay = _jobs[i]._tty.learned[m];
+        }
+      }
+      if (delay > 0) { settings->learned[m] = delay; }
+    }
+  }
+
+  /*
+   * Append each finished job's ReflashStats to fileName.
+   */
+  void Log(const TCHAR *fileName)
+  {
+    int i;
+
+    for (i = 0; i < _count; i++) {
+      if (_jobs[i]._done) { _jobs[i]._stats.Log(fileName, _jobs[i]._port, _jobs[i]._ok); }
+    }
+  }
+
+  /*
+   * Aggregate progress, e.g. "24 readers: 20 done, 1 failed, 3 running (61%)".
+   */
+  void Summary(TCHAR *buf, int len)
+  {
+    int i, done, failed, lines, total;
+
+    done = failed = lines = total = 0;
+    for (i = 0; i < _count; i++) {
+      GangJob *job = &_jobs[i];
+      if (job->_done) {
+        if (job->_ok) { done++; } else { failed++; }
+      }
+      lines += job->_line;
+      total += job->_total;
+    }
+    sprintf_t(buf, len, _T("%d readers: %d done, %d failed, %d running (%d%%)"),
+        _count, done, failed, _count - done - failed,
+        (total > 0) ? (int) ((double) lines * 100 / total) : 0);
+  }
+
+  /*
+   * One line per port: where it got to and how it ended.
+   */
+  void Report(int i, char *buf, int len)
+  {
+    GangJob *job = &_jobs[i];
+    TCHAR status[128];
+
+    job->GetStatus(status, _countof(status));
+    StringCchPrintfA(buf, len, "%" PRI_TS ": %" PRI_TS ", line %d/%d, %d.%d s%s%s\n",
+        job->_port, status, job->_line, job->_total,
+        (int) (job->_elapsed / 1000), (int) (job->_elapsed / 100) % 10,
+        (job->_ok || job->_last[0] == '\0') ? "" : ", last: ",
+        job->_ok ? "" : job->_last);
+  }
+};
+
+#endif
@@ -0,0 +1,668 @@
+#if !defined(_MACRO_H)
+#define _MACRO_H
+
+/*
+ * macro.h --
+ *
+ * Command files for the CMD> shell, compiled once before any of it is
+ * sent.  A plain line is a command, sent with "\r" on the end; a line
+ * starting with # is a comment that is only shown.  $name or ${name}
+ * in either is replaced by a variable, and $$ is a $.
+ *
+ * A line starting with . is a directive:
+ *
+ *   .set NAME VALUE      set a variable
+ *   .csv FILE            set variables from row $unit of a CSV file,
+ *                        named by its header row
+ *   .expect TEXT [MS]    wait for TEXT from the reader
+ *   .if-match TEXT       run up to .else or .end if the last answer,
+ *   .if-no-match TEXT    or .expect, held TEXT (or did not)
+ *   .else
+ *   .loop N              run up to .end N times, with $loop counting
+ *   .end
+ *   .timeout MS          wait this long for each answer
+ *   .retry N             send a rejected or unanswered command again,
+ *                        up to N times
+ *   .wait MS
+ *   .echo TEXT           show TEXT on the console
+ *   .fail TEXT           stop with TEXT as the error
+ *
+ * Any other line starting with . is sent as it is, as command files
+ * did before directives.  A line starting with .. is sent with the
+ * first . taken off.  TEXT may be in double quotes.
+ *
+ * Macro holds the compiled file; MacroRun is one play of it, leaving
+ * the port to Reader::PlayMacro().
+ */
+
+#define MACRO_VARS		64
+#define MACRO_NAME		32
+#define MACRO_VALUE		128
+#define MACRO_NEST		8	/* .if and .loop inside each other. */
+#define MACRO_LINE		512	/* A line with its variables in. */
+#define MACRO_REPLY		1000
+#define MACRO_COLUMNS		32
+
+enum {
+  MACRO_SEND,
+  MACRO_COMMENT,
+  MACRO_ECHO,
+  MACRO_SET,
+  MACRO_CSV,
+  MACRO_EXPECT,
+  MACRO_IF,		/* To jump unless the last answer matches. */
+  MACRO_IFNOT,
+  MACRO_JUMP,
+  MACRO_LOOP,		/* To jump if the count is used up. */
+  MACRO_NEXT,		/* Back to jump, the first line of the loop. */
+  MACRO_TIMEOUT,
+  MACRO_RETRY,
+  MACRO_WAIT,
+  MACRO_FAIL
+};
+
+struct MacroOp
+{
+  int op;		/* MACRO_xxx */
+  int srcLine;		/* Line number in the file, for error messages. */
+  int text;		/* Offsets in Macro::_text, or -1. */
+  int arg;
+  int jump;		/* Op to go on at, for control directives. */
+};
+
+/*
+ * Variables for a play.  Names and values are as sent, not TCHAR.
+ */
+struct MacroVars
+{
+  char _name[MACRO_VARS][MACRO_NAME];
+  char _value[MACRO_VARS][MACRO_VALUE];
+  int _count;
+
+  MacroVars() : _count(0) {}
+
+  const char *Get(const char *name, int len = -1) const
+  {
+    int i;
+
+    if (len < 0) { len = (int) strlen(name); }
+    if (len >= MACRO_NAME) { return NULL; }
+    for (i = 0; i < _count; i++) {
+      if (strncmp(_name[i], name, len) == 0 && _name[i][len] == '\0') { return _value[i]; }
+    }
+    return NULL;
+  }
+
+  BOOL Set(const char *name, const char *value)
+  {
+    int i;
+
+    if (strlen(name) >= MACRO_NAME) { return FALSE; }
+    for (i = 0; i < _count; i++) {
+      if (strcmp(_name[i], name) == 0) { break; }
+    }
+    if (i == MACRO_VARS) { return FALSE; }
+    if (i == _count) {
+      strcpy_tA(_name[i], MACRO_NAME, name);
+      _count++;
+    }
+    strcpy_tA(_value[i], MACRO_VALUE, value);
+    return TRUE;
+  }
+
+  void SetInt(const char *name, int value)
+  {
+    char buf[16];
+
+    StringCchPrintfA(buf, _countof(buf), "%d", value);
+    Set(name, buf);
+  }
+
+  /*
+   * "NAME=VALUE", as from a command line.
+   */
+  BOOL Assign(const TCHAR *src)
+  {
+    char buf[MACRO_NAME + MACRO_VALUE];
+    char *eq;
+
+    StringCchPrintfA(buf, _countof(buf), "%" PRI_TS, src);
+    eq = strchr(buf, '=');
+    if (eq == NULL || eq == buf) { return FALSE; }
+    *eq = '\0';
+    return Set(buf, eq + 1);
+  }
+};
+
+struct Macro
+{
+  MacroOp *_ops;
+  int _count;
+  char *_text;
+  char _dir[MAX_PATH];	/* Where the file is, for .csv files. */
+
+  TCHAR _error[160];	/* Why Load() failed. */
+
+  Macro()
+  {
+    _ops = NULL;
+    _text = NULL;
+    Free();
+  }
+
+  ~Macro()
+  {
+    Free();
+  }
+
+  void Free()
+  {
+    delete [] _ops;
+    delete [] _text;
+
+    _ops = NULL;
+    _count = 0;
+    _text = NULL;
+    _dir[0] = '\0';
+    _error[0] = '\0';
+  }
+
+  const char *Text(int offset) const
+  {
+    return (offset >= 0) ? _text + offset : "";
+  }
+
+  /*
+   * Read and compile a command file.
+   */
+  BOOL Load(const TCHAR *fileName)
+  {
+    FILE *f = NULL;
+    char *src = NULL;
+    long size;
+    BOOL ok;
+    int i;
+
+    Free();
+
+    if ((fileName == NULL) || (fileName[0] == '\0')) {
+      strcpy_t(_error, _countof(_error), _T("No command file"));
+      return FALSE;
+    }
+
+    StringCchPrintfA(_dir, _countof(_dir), "%" PRI_TS, fileName);
+    for (i = (int) strlen(_dir); i > 0 && _dir[i - 1] != '/' && _dir[i - 1] != '\\'; i--) {}
+    _dir[i] = '\0';
+
+    f = _tfopen(fileName, _T("rb"));
+    if (f == NULL) { goto badfile; }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0) { goto badfile; }
+
+    src = new char[size + 1];
+    if ((long) fread(src, 1, size, f) != size) { goto badfile; }
+    src[size] = '\0';
+    fclose(f);
+
+    ok = Compile(src, size);
+    delete [] src;
+    return ok;
+
+badfile:
+    if (f != NULL) { fclose(f); }
+    delete [] src;
+    strcpy_t(_error, _countof(_error), _T("Cannot open command file"));
+    return FALSE;
+  }
+
+private:
+  /*
+   * Leading and trailing blanks are trimmed; a blank line is still
+   * sent, as a bare "\r".
+   */
+  BOOL Compile(char *src, long size)
+  {
+    static const struct {
+      const char *name;
+      int op;
+      int args;		/* 0 none, 1 TEXT, 2 TEXT [MORE], 3 NAME VALUE */
+    } directives[] = {
+      { "echo", MACRO_ECHO, 1 },
+      { "set", MACRO_SET, 3 },
+      { "csv", MACRO_CSV, 1 },
+      { "expect", MACRO_EXPECT, 2 },
+      { "if-match", MACRO_IF, 1 },
+      { "if-no-match", MACRO_IFNOT, 1 },
+      { "else", MACRO_JUMP, 0 },
+      { "loop", MACRO_LOOP, 1 },
+      { "end", MACRO_NEXT, 0 },
+      { "timeout", MACRO_TIMEOUT, 1 },
+      { "retry", MACRO_RETRY, 1 },
+      { "wait", MACRO_WAIT, 1 },
+      { "fail", MACRO_FAIL, 1 },
+    };
+    int nest[MACRO_NEST];	/* Open .if, .else and .loop ops. */
+    char *p, *end, *dst, *sep;
+    int i, d, n, depth, lines, len;
+
+    lines = 1;
+    for (i = 0; i < size; i++) {
+      if (src[i] == '\n') { lines++; }
+    }
+    _ops = new MacroOp[lines];
+    _text = new char[size + 2 * lines + 1];
+    dst = _text;
+    depth = 0;
+
+    for (p = src, n = 1; *p != '\0'; p = end, n++) {
+      MacroOp *op = &_ops[_count];
+
+      for (end = p; *end != '\0' && *end != '\n'; end++) {}
+      len = (int) (end - p);
+      if (*end == '\n') { end++; }
+
+      while (len > 0 && (*p == ' ' || *p == '\t' || *p == '\r')) { p++; len--; }
+      while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t' || p[len - 1] == '\r')) { len--; }
+
+      op->srcLine = n;
+      op->text = op->arg = op->jump = -1;
+      _count++;
+
+      if (len == 0 || p[0] != '.' || (len > 1 && p[1] == '.')) {
+        op->op = (len > 0 && p[0] == '#') ? MACRO_COMMENT : MACRO_SEND;
+        if (len > 0 && p[0] == '.') { p++; len--; }
+        op->text = Keep(&dst, p, len);
+        continue;
+      }
+
+      // Directive name, then its arguments.
+      for (sep = p + 1; sep < p + len && *sep != ' ' && *sep != '\t'; sep++) {}
+      for (d = 0; d < (int) _countof(directives); d++) {
+        if ((int) strlen(directives[d].name) == sep - p - 1
+            && strncmp(directives[d].name, p + 1, sep - p - 1) == 0) { break; }
+      }
+      if (d == (int) _countof(directives)) {
+        op->op = MACRO_SEND;
+        op->text = Keep(&dst, p, len);
+        continue;
+      }
+      op->op = directives[d].op;
+
+      len -= (int) (sep - p);
+      p = sep;
+      while (len > 0 && (*p == ' ' || *p == '\t')) { p++; len--; }
+
+      if (directives[d].args == 0) {
+        if (len > 0) { return Error(n, _T("nothing should follow")); }
+      } else if (len == 0) {
+        return Error(n, _T("missing argument"));
+      } else if (directives[d].args == 1) {
+        op->text = Keep(&dst, p, len, TRUE);
+      } else {
+        // First word, or quoted text, then the rest.
+        if (*p == '"') {
+          for (sep = p + 1; sep < p + len && *sep != '"'; sep++) {}
+          if (sep == p + len) { return Error(n, _T("missing \"")); }
+          sep++;
+        } else {
+          for (sep = p; sep < p + len && *sep != ' ' && *sep != '\t'; sep++) {}
+        }
+        op->text = Keep(&dst, p, (int) (sep - p), TRUE);
+        if (op->op == MACRO_SET && strlen(_text + op->text) >= MACRO_NAME) {
+          return Error(n, _T("variable name too long"));
+        }
+        len -= (int) (sep - p);
+        p = sep;
+        while (len > 0 && (*p == ' ' || *p == '\t')) { p++; len--; }
+        if (len > 0) {
+          op->arg = Keep(&dst, p, len, TRUE);
+        } else if (directives[d].args == 3) {
+          return Error(n, _T("missing value"));
+        }
+      }
+
+      // Tie up .if, .else, .loop and .end.
+      if (op->op == MACRO_IF || op->op == MACRO_IFNOT || op->op == MACRO_LOOP) {
+        if (depth == MACRO_NEST) { return Error(n, _T("nested too deep")); }
+        nest[depth++] = _count - 1;
+      } else if (op->op == MACRO_JUMP) {
+        if (depth == 0 || (_ops[nest[depth - 1]].op != MACRO_IF
+            && _ops[nest[depth - 1]].op != MACRO_IFNOT)) {
+          return Error(n, _T(".else without .if"));
+        }
+        _ops[nest[depth - 1]].jump = _count;
+        nest[depth - 1] = _count - 1;
+      } else if (op->op == MACRO_NEXT) {
+        MacroOp *open;
+
+        if (depth == 0) { return Error(n, _T(".end without .if or .loop")); }
+        open = &_ops[nest[--depth]];
+        if (open->op == MACRO_LOOP) {
+          op->jump = nest[depth] + 1;
+        } else {
+          // An .if or .else just falls through its .end.
+          op->op = MACRO_JUMP;
+          op->jump = _count;
+        }
+        open->jump = _count;
+      }
+    }
+    *dst = '\0';
+
+    if (depth > 0) { return Error(_ops[nest[depth - 1]].srcLine, _T("no .end")); }
+    return TRUE;
+  }
+
+  /*
+   * Copy len characters of src into the text, less any quotes round
+   * them if unquote.  Returns the offset of the copy.
+   */
+  int Keep(char **dst, const char *src, int len, BOOL unquote = FALSE)
+  {
+    int offset = (int) (*dst - _text);
+
+    if (unquote && len >= 2 && src[0] == '"' && src[len - 1] == '"') {
+      src++;
+      len -= 2;
+    }
+    memcpy(*dst, src, len);
+    *dst += len;
+    *(*dst)++ = '\0';
+    return offset;
+  }
+
+  BOOL Error(int line, const TCHAR *msg)
+  {
+    sprintf_t(_error, _countof(_error), _T("Command file line %d: %s"), line, msg);
+    delete [] _ops;
+    delete [] _text;
+    _ops = NULL;
+    _text = NULL;
+    _count = 0;
+    return FALSE;
+  }
+};
+
+/*
+ * One play of a Macro: where it has got to and what it has learnt.
+ * Everything but the port I/O is done here.
+ */
+struct MacroRun
+{
+  const Macro *_macro;
+  MacroVars *_vars;
+  int _pc;		/* Next op. */
+  int _timeout;		/* ms to wait for each answer. */
+  int _retry;		/* Times to send a command again. */
+  int _loops[MACRO_NEST][2];	/* Passes left and done, innermost last. */
+  int _depth;
+  char _last[MACRO_REPLY];	/* Last answer, less echo and prompt. */
+
+  TCHAR _error[160];
+
+  MacroRun(const Macro *macro, MacroVars *vars, int timeout)
+  {
+    _macro = macro;
+    _vars = vars;
+    _pc = 0;
+    _timeout = timeout;
+    _retry = 0;
+    _depth = 0;
+    _last[0] = '\0';
+    _error[0] = '\0';
+  }
+
+  const MacroOp *Op() const
+  {
+    return (_pc < _macro->_count) ? &_macro->_ops[_pc] : NULL;
+  }
+
+  /*
+   * Copy the text at offset into dst with its variables in.
+   */
+  BOOL Expand(int offset, char *dst, int len)
+  {
+    const char *src = _macro->Text(offset);
+    const char *name, *value;
+    int used = 0, n;
+
+    while (*src != '\0') {
+      if (src[0] != '$' || src[1] == '\0') {
+        if (used < len - 1) { dst[used++] = *src; }
+        src++;
+        continue;
+      }
+      if (src[1] == '$') {
+        if (used < len - 1) { dst[used++] = '$'; }
+        src += 2;
+        continue;
+      }
+
+      name = src + ((src[1] == '{') ? 2 : 1);
+      for (n = 0; isalnum((byte) name[n]) || name[n] == '_'; n++) {}
+      if (n == 0 || (src[1] == '{' && name[n] != '}')) {
+        if (used < len - 1) { dst[used++] = *src; }
+        src++;
+        continue;
+      }
+
+      value = _vars->Get(name, n);
+      if (value == NULL) {
+        char bad[MACRO_NAME];
+
+        StringCchPrintfA(bad, _countof(bad), "%.*s", n, name);
+        return Error(_T("no variable %") PRI_AS, bad);
+      }
+      while (*value != '\0' && used < len - 1) { dst[used++] = *value++; }
+      src = name + n + ((src[1] == '{') ? 1 : 0);
+    }
+    dst[used] = '\0';
+    return TRUE;
+  }
+
+  /*
+   * Number argument at offset.
+   */
+  BOOL Number(int offset, int *value)
+  {
+    char buf[MACRO_VALUE], *end;
+
+    if (Expand(offset, buf, _countof(buf)) == FALSE) { return FALSE; }
+    *value = (int) strtol(buf, &end, 0);
+    if (end == buf || *end != '\0') { return Error(_T("%") PRI_AS _T(" is not a number"), buf); }
+    return TRUE;
+  }
+
+  /*
+   * Keep what came back for a command, for .if-match: the echo of the
+   * command and the prompt are left out.
+   */
+  void Answer(const char *reply, const char *cmd)
+  {
+    int len = (int) strlen(cmd);
+
+    if (len > 0 && strncmp(reply, cmd, len) == 0) { reply += len; }
+    while (*reply == '\r' || *reply == '\n') { reply++; }
+    strcpy_tA(_last, _countof(_last), reply);
+    len = (int) strlen(_last);
+    if (len >= 4 && strcmp(_last + len - 4, "CMD>") == 0) { _last[len - 4] = '\0'; }
+  }
+
+  /*
+   * Carry out the directive at _pc that needs no port, and move on.
+   * Returns FALSE, with _error set, to stop.
+   */
+  BOOL Step()
+  {
+    const MacroOp *op = Op();
+    char buf[MACRO_LINE];
+    int n;
+
+    switch (op->op) {
+    case MACRO_SET:
+      if (Expand(op->arg, buf, _countof(buf)) == FALSE) { return FALSE; }
+      if (_vars->Set(_macro->Text(op->text), buf) == FALSE) { return Error(_T("too many variables")); }
+      break;
+
+    case MACRO_CSV:
+      if (Expand(op->text, buf, _countof(buf)) == FALSE) { return FALSE; }
+      if (Csv(buf) == FALSE) { return FALSE; }
+      break;
+
+    case MACRO_IF:
+    case MACRO_IFNOT:
+      if (Expand(op->text, buf, _countof(buf)) == FALSE) { return FALSE; }
+      if ((strstr(_last, buf) != NULL) != (op->op == MACRO_IF)) {
+        _pc = op->jump;
+        return TRUE;
+      }
+      break;
+
+    case MACRO_JUMP:
+      _pc = op->jump;
+      return TRUE;
+
+    case MACRO_LOOP:
+      if (Number(op->text, &n) == FALSE) { return FALSE; }
+      if (n <= 0) {
+        _pc = op->jump;
+        return TRUE;
+      }
+      _loops[_depth][0] = n;
+      _loops[_depth][1] = 1;
+      _depth++;
+      _vars->SetInt("loop", 1);
+      break;
+
+    case MACRO_NEXT:
+      if (--_loops[_depth - 1][0] > 0) {
+        _vars->SetInt("loop", ++_loops[_depth - 1][1]);
+        _pc = op->jump;
+        return TRUE;
+      }
+      if (--_depth > 0) { _vars->SetInt("loop", _loops[_depth - 1][1]); }
+      break;
+
+    case MACRO_TIMEOUT:
+      if (Number(op->text, &_timeout) == FALSE) { return FALSE; }
+      break;
+
+    case MACRO_RETRY:
+      if (Number(op->text, &_retry) == FALSE) { return FALSE; }
+      break;
+
+    case MACRO_FAIL:
+      if (Expand(op->text, buf, _countof(buf)) == FALSE) { return FALSE; }
+      return Error(_T("%") PRI_AS, buf);
+    }
+
+    _pc++;
+    return TRUE;
+  }
+
+  /*
+   * Set variables from row $unit of a CSV file, the first row being
+   * their names.  A relative name is from the command file's folder.
+   */
+  BOOL Csv(const char *fileName)
+  {
+    char path[MAX_PATH], names[MACRO_REPLY], row[MACRO_REPLY];
+    char *name[MACRO_COLUMNS], *value[MACRO_COLUMNS];
+    const char *unit = _vars->Get("unit");
+    FILE *f;
+    int i, n, want, count;
+
+    if (fileName[0] == '/' || fileName[0] == '\\' || (fileName[0] != '\0' && fileName[1] == ':')) {
+      strcpy_tA(path, _countof(path), fileName);
+    } else {
+      StringCchPrintfA(path, _countof(path), "%s%s", _macro->_dir, fileName);
+    }
+    want = (unit != NULL) ? atoi(unit) : 1;
+
+    f = fopen(path, "r");
+    if (f == NULL) { return Error(_T("cannot open %") PRI_AS, path); }
+
+    count = 0;
+    if (CsvRow(f, names) == FALSE) {
+      fclose(f);
+      return Error(_T("%") PRI_AS _T(" is empty"), path);
+    }
+    count = CsvSplit(names, name);
+    for (i = 0; i < want && CsvRow(f, row); i++) {}
+    fclose(f);
+    if (want < 1 || i < want) { return Error(_T("no unit %d in %") PRI_AS, want, path); }
+
+    n = CsvSplit(row, value);
+    for (i = 0; i < count; i++) {
+      if (name[i][0] == '\0') { continue; }
+      if (_vars->Set(name[i], (i < n) ? value[i] : "") == FALSE) {
+        return Error(_T("cannot set %") PRI_AS, name[i]);
+      }
+    }
+    return TRUE;
+  }
+
+  /*
+   * Set _error for the op at _pc.  Returns FALSE.
+   */
+  BOOL Error(const TCHAR *fmt, ...)
+  {
+    TCHAR msg[120];
+    va_list args;
+
+    va_start(args, fmt);
+    _vsntprintf(msg, _countof(msg) - 1, fmt, args);
+    msg[_countof(msg) - 1] = '\0';
+    va_end(args);
+
+    sprintf_t(_error, _countof(_error), _T("Command file line %d: %s"),
+        (Op() != NULL) ? Op()->srcLine : _macro->_count, msg);
+    return FALSE;
+  }
+
+private:
+  /*
+   * Next row that isn't blank, without its line end.
+   */
+  static BOOL CsvRow(FILE *f, char *buf)
+  {
+    while (fgets(buf, MACRO_REPLY, f) != NULL) {
+      StrTrimA(buf, "\r\n");
+      if (buf[0] != '\0') { return TRUE; }
+    }
+    return FALSE;
+  }
+
+  /*
+   * Split a row in place.  Fields may be in double quotes, with "" for
+   * a quote inside.  Returns how many.
+   */
+  static int CsvSplit(char *src, char **fields)
+  {
+    char *dst;
+    int n = 0;
+
+    while (n < MACRO_COLUMNS) {
+      fields[n++] = dst = src;
+      if (*src == '"') {
+        for (src++; *src != '\0'; src++) {
+          if (*src == '"' && *++src != '"') { break; }
+          *dst++ = *src;
+        }
+      }
+      while (*src != '\0' && *src != ',') { *dst++ = *src++; }
+      if (*src == '\0') {
+        *dst = '\0';
+        break;
+      }
+      *dst = '\0';
+      src++;
+    }
+    return n;
+  }
+};
+
+#endif
@@ -0,0 +1,412 @@
+#if !defined(_PORTS_H)
+#define _PORTS_H
+
+/*
+ * ports.h --
+ *
+ * The serial ports there are, enumerated once and then kept up to date
+ * as devices come and go, instead of probing every name whenever
+ * someone asks.
+ *
+ * On Win32 Refresh() reads the SERIALCOMM key, where the serial drivers
+ * list the ports they have.  A window passes WM_DEVICECHANGE port
+ * arrivals and removals to Arrived() and Removed(); without one, Watch()
+ * and Wait() follow changes to the key.  On POSIX Refresh() lists the
+ * ttys in /sys/class/tty that have a device behind them, and Watch()
+ * and Wait() follow the device nodes udev adds and removes, with
+ * inotify.
+ *
+ * Changes() counts updates, so a thread can tell cheaply whether
+ * anything happened since it last looked.  Any thread may ask; the
+ * list is locked while it changes.
+ */
+
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#endif
+
+#define PORTS_MAX		256
+
+#if defined(_WIN32)
+#define PORT_NAME		16	/* "COMnnn:" */
+#else
+#define PORT_NAME		64	/* A path. */
+#endif
+
+struct PortList
+{
+  TCHAR _names[PORTS_MAX][PORT_NAME];	/* Sorted; "COMn:" on Win32. */
+  int _count;
+  volatile LONG _changes;
+  CRITICAL_SECTION _lock;	// Guards _names and _count.
+#if defined(_WIN32)
+  HKEY _key;			/* SERIALCOMM, NULL if not watching. */
+  HANDLE _changed;		/* Set when the key changes. */
+#else
+  int _fd;			/* inotify, -1 if not watching. */
+  char _dir[MAX_PATH];		/* What it watches. */
+#endif
+
+  PortList()
+  {
+    _count = 0;
+    _changes = 0;
+    InitializeCriticalSection(&_lock);
+#if defined(_WIN32)
+    _key = NULL;
+    _changed = NULL;
+#else
+    _fd = -1;
+    _dir[0] = '\0';
+#endif
+  }
+
+  ~PortList()
+  {
+#if defined(_WIN32)
+    if (_key != NULL) { RegCloseKey(_key); }
+    if (_changed != NULL) { CloseHandle(_changed); }
+#else
+    if (_fd >= 0) { close(_fd); }
+#endif
+    DeleteCriticalSection(&_lock);
+  }
+
+  LONG Changes() const { return _changes; }
+
+  /*
+   * Same port, with or without the trailing ':' on Win32.
+   */
+  static BOOL Same(const TCHAR *a, const TCHAR *b)
+  {
+    int len = lstrlen(a);
+
+    if (len > 0 && a[len - 1] == ':') { len--; }
+    if (_tcsnicmp(a, b, len) != 0) { return FALSE; }
+    return b[len] == '\0' || (b[len] == ':' && b[len + 1] == '\0');
+  }
+
+  /*
+   * Names in order, with runs of digits as numbers, so COM2 comes
+   * before COM10.
+   */
+  static int Compare(const TCHAR *a, const TCHAR *b)
+  {
+    while (*a != '\0' && *b != '\0') {
+      if (_istdigit(*a) && _istdigit(*b)) {
+        long x = _tcstol(a, (TCHAR **) &a, 10);
+        long y = _tcstol(b, (TCHAR **) &b, 10);
+
+        if (x != y) { return (x < y) ? -1 : 1; }
+        continue;
+      }
+      if (_totupper(*a) != _totupper(*b)) { return _totupper(*a) - _totupper(*b); }
+      a++;
+      b++;
+    }
+    return *a - *b;
+  }
+
+  BOOL Has(const TCHAR *name)
+  {
+    BOOL found = FALSE;
+    int i;
+
+    EnterCriticalSection(&_lock);
+    for (i = 0; i < _count && found == FALSE; i++) {
+      found = Same(_names[i], name);
+    }
+    LeaveCriticalSection(&_lock);
+    return found;
+  }
+
+  /*
+   * Up to max names as they are now.  On Win32 there is always at
+   * least "COM1:" to offer.
+   */
+  int Copy(TCHAR ports[][PORT_NAME], int max)
+  {
+    int i, count;
+
+    EnterCriticalSection(&_lock);
+    count = min(_count, max);
+    for (i = 0; i < count; i++) {
+      strcpy_t(ports[i], PORT_NAME, _names[i]);
+    }
+    LeaveCriticalSection(&_lock);
+#if defined(_WIN32)
+    if (count == 0 && max > 0) {
+      strcpy_t(ports[count++], PORT_NAME, _T("COM1:"));
+    }
+#endif
+    return count;
+  }
+
+  /*
+   * A port came.  Returns FALSE if it was already there.
+   */
+  BOOL Arrived(const TCHAR *name)
+  {
+    BOOL added = FALSE;
+
+    EnterCriticalSection(&_lock);
+    if (Find(name) < 0 && _count < PORTS_MAX) {
+      Insert(name);
+      InterlockedIncrement(&_changes);
+      added = TRUE;
+    }
+    LeaveCriticalSection(&_lock);
+    return added;
+  }
+
+  /*
+   * A port went.  Returns FALSE if it was not there.
+   */
+  BOOL Removed(const TCHAR *name)
+  {
+    BOOL removed = FALSE;
+    int i;
+
+    EnterCriticalSection(&_lock);
+    i = Find(name);
+    if (i >= 0) {
+      for (_count--; i < _count; i++) {
+        strcpy_t(_names[i], PORT_NAME, _names[i + 1]);
+      }
+      InterlockedIncrement(&_changes);
+      removed = TRUE;
+    }
+    LeaveCriticalSection(&_lock);
+    return removed;
+  }
+
+#if defined(_WIN32)
+
+  /*
+   * Enumerate the ports from scratch.  One registry read, however
+   * many COM numbers there could be.
+   */
+  BOOL Refresh()
+  {
+    TCHAR value[64], data[PORT_NAME];
+    DWORD i, valueLen, dataLen, type;
+    HKEY key;
+
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, _T("HARDWARE\\DEVICEMAP\\SERIALCOMM"),
+        0, KEY_READ, &key) != ERROR_SUCCESS) {
+      return FALSE;
+    }
+
+    EnterCriticalSection(&_lock);
+    _count = 0;
+    for (i = 0; _count < PORTS_MAX; i++) {
+      valueLen = _countof(value);
+      dataLen = sizeof(data) - 2 * sizeof(TCHAR);
+      if (RegEnumValue(key, i, value, &valueLen, NULL, &type, (LPBYTE) data,
+          &dataLen) != ERROR_SUCCESS) {
+        break;
+      }
+      if (type != REG_SZ) { continue; }
+      data[dataLen / sizeof(TCHAR)] = '\0';
+      strcat_t(data, _countof(data), _T(":"));
+      if (Find(data) < 0) { Insert(data); }
+    }
+    InterlockedIncrement(&_changes);
+    LeaveCriticalSection(&_lock);
+
+    RegCloseKey(key);
+    return TRUE;
+  }
+
+  /*
+   * Follow changes to the key from now on, for a program with no
+   * window to get WM_DEVICECHANGE.
+   */
+  BOOL Watch()
+  {
+    if (_key == NULL && RegOpenKeyEx(HKEY_LOCAL_MACHINE,
+        _T("HARDWARE\\DEVICEMAP\\SERIALCOMM"), 0, KEY_NOTIFY, &_key) != ERROR_SUCCESS) {
+      _key = NULL;
+      return FALSE;
+    }
+    if (_changed == NULL) { _changed = CreateEvent(NULL, FALSE, FALSE, NULL); }
+    return RegNotifyChangeKeyValue(_key, FALSE, REG_NOTIFY_CHANGE_LAST_SET, _changed,
+        TRUE) == ERROR_SUCCESS;
+  }
+
+  /*
+   * Wait up to ms for a port to come or go.  Returns TRUE if the list
+   * changed, FALSE on timeout or if nothing is watched.
+   */
+  BOOL Wait(DWORD ms)
+  {
+    if (_key == NULL) { return FALSE; }
+    if (WaitForSingleObject(_changed, ms) != WAIT_OBJECT_0) { return FALSE; }
+    // Notification is one-shot; ask again before looking, so nothing
+    // in between is missed.
+    Watch();
+    return Refresh();
+  }
+
+#else
+
+  /*
+   * Enumerate the ports from scratch: every tty the kernel has a
+   * device for, plus whatever is in the watched directory.
+   */
+  BOOL Refresh()
+  {
+    struct dirent *ent;
+    char path[MAX_PATH];
+    struct stat st;
+    DIR *dir;
+
+    dir = opendir("/sys/class/tty");
+    if (dir == NULL) { return FALSE; }
+
+    EnterCriticalSection(&_lock);
+    _count = 0;
+    while ((ent = readdir(dir)) != NULL && _count < PORTS_MAX) {
+      if (ent->d_name[0] == '.') { continue; }
+      sprintf_t(path, _countof(path), "/sys/class/tty/%s/device", ent->d_name);
+      if (stat(path, &st) != 0) { continue; }
+      sprintf_t(path, _countof(path), "/dev/%s", ent->d_name);
+      if (Find(path) < 0) { Insert(path); }
+    }
+    closedir(dir);
+    if (_dir[0] != '\0') { AddDir(); }
+    InterlockedIncrement(&_changes);
+    LeaveCriticalSection(&_lock);
+    return TRUE;
+  }
+
+  /*
+   * Follow device nodes coming and going in dirName from now on:
+   * "/dev" for real ports, or a directory of links to them such as
+   * /dev/serial/by-id.  One directory at a time.
+   */
+  BOOL Watch(const char *dirName)
+  {
+    if (_fd < 0) {
+      _fd = inotify_init();
+      if (_fd < 0) { return FALSE; }
+      fcntl(_fd, F_SETFL, O_NONBLOCK);
+    }
+    if (inotify_add_watch(_fd, dirName, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+      return FALSE;
+    }
+    strcpy_t(_dir, _countof(_dir), dirName);
+
+    EnterCriticalSection(&_lock);
+    AddDir();
+    LeaveCriticalSection(&_lock);
+    return TRUE;
+  }
+
+  /*
+   * Wait up to ms for a port to come or go.  Returns TRUE if the list
+   * changed, FALSE on timeout, on a signal, or if nothing is watched.
+   */
+  BOOL Wait(DWORD ms)
+  {
+    char buf[4096], path[MAX_PATH];
+    struct inotify_event *ev;
+    struct pollfd fds;
+    LONG before = _changes;
+    int n, i;
+
+    if (_fd < 0) { return FALSE; }
+
+    fds.fd = _fd;
+    fds.events = POLLIN;
+    if (poll(&fds, 1, (ms == INFINITE) ? -1 : (int) ms) <= 0) { return FALSE; }
+
+    while ((n = (int) read(_fd, buf, sizeof(buf))) > 0) {
+      for (i = 0; i < n; i += sizeof(*ev) + ev->len) {
+        ev = (struct inotify_event *) &buf[i];
+        if (ev->len == 0) { continue; }
+        sprintf_t(path, _countof(path), "%s/%s", _dir, ev->name);
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+          if (IsPort(_dir, ev->name)) { Arrived(path); }
+        } else {
+          Removed(path);
+        }
+      }
+    }
+    return _changes != before;
+  }
+
+#endif
+
+private:
+
+  int Find(const TCHAR *name)
+  {
+    int i;
+
+    for (i = 0; i < _count; i++) {
+      if (Same(_names[i], name)) { return i; }
+    }
+    return -1;
+  }
+
+  /*
+   * Into its place in the order.  Caller holds the lock and has
+   * checked there is room.
+   */
+  void Insert(const TCHAR *name)
+  {
+    int i;
+
+    for (i = _count; i > 0 && Compare(_names[i - 1], name) > 0; i--) {
+      strcpy_t(_names[i], PORT_NAME, _names[i - 1]);
+    }
+    strcpy_t(_names[i], PORT_NAME, name);
+    _count++;
+  }
+
+#if !defined(_WIN32)
+
+  /*
+   * In /dev only the tty nodes are ports; elsewhere, any character
+   * device, so links made by udev rules or a simulator count too.
+   */
+  static BOOL IsPort(const char *dirName, const char *name)
+  {
+    char path[MAX_PATH];
+    struct stat st;
+
+    if (strcmp(dirName, "/dev") == 0 && strncmp(name, "tty", 3) != 0) { return FALSE; }
+    sprintf_t(path, _countof(path), "%s/%s", dirName, name);
+    return stat(path, &st) == 0 && S_ISCHR(st.st_mode);
+  }
+
+  /*
+   * Add the ports already in the watched directory.  In /dev those
+   * came from /sys/class/tty already.  Caller holds the lock.
+   */
+  void AddDir()
+  {
+    struct dirent *ent;
+    char path[MAX_PATH];
+    DIR *dir;
+
+    if (strcmp(_dir, "/dev") == 0) { return; }
+    dir = opendir(_dir);
+    if (dir == NULL) { return; }
+    while ((ent = readdir(dir)) != NULL && _count < PORTS_MAX) {
+      if (ent->d_name[0] == '.' || IsPort(_dir, ent->d_name) == FALSE) { continue; }
+      sprintf_t(path, _countof(path), "%s/%s", _dir, ent->d_name);
+      if (Find(path) < 0) { Insert(path); }
+    }
+    closedir(dir);
+  }
+
+#endif
+};
+
+#endif
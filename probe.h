@@ -0,0 +1,154 @@
+#if !defined(_PROBE_H)
+#define _PROBE_H
+
+/*
+ * probe.h --
+ *
+ * Reader discovery: knock on every serial port at once and see which
+ * ones answer with a Boot> or CMD> prompt.  Each port gets its own
+ * Reader on its own thread, so finding a reader takes one probe time
+ * however many ports there are.
+ */
+
+#define PROBE_TRIES		3
+#define PROBE_DEADLINE		(PROBE_TRIES * CMD_TIMEOUT + 1000)
+
+struct Probe : public Reader
+{
+  TCHAR _port[64];
+  HANDLE _thread;
+
+  int _found;		/* Index of prompt that answered, or -1. */
+  DWORD _err;		/* Why the port would not open, or 0. */
+  volatile BOOL _done;
+
+  Probe()
+  {
+    _port[0] = '\0';
+    _thread = NULL;
+    _found = -1;
+    _err = 0;
+    _done = FALSE;
+  }
+
+  ~Probe()
+  {
+    Join();
+  }
+
+  void Join()
+  {
+    if (_thread != NULL) {
+      WaitForSingleObject(_thread, INFINITE);
+      CloseHandle(_thread);
+      _thread = NULL;
+    }
+  }
+
+  static DWORD CALLBACK ProbeThread(LPVOID param)
+  {
+    ((Probe *) param)->Run();
+    return 0;
+  }
+
+  void Run()
+  {
+    static const char *prompts[] = { "Boot>", "CMD>" };
+    int i;
+
+    if (Port_Open(_port) == FALSE) {
+      _err = GetLastError();
+    } else {
+      for (i = 0; (i < PROBE_TRIES) && (_found < 0) && (_stop == FALSE); i++) {
+        Port_Send("\r");
+        _found = Port_ExpectAny(prompts, _countof(prompts));
+      }
+      _tty.comm.Close();
+    }
+    _done = TRUE;
+  }
+};
+
+struct Discovery
+{
+  Probe *_probes;
+  int _count;
+
+  Discovery() : _probes(NULL), _count(0) {}
+
+  ~Discovery()
+  {
+    Finish();
+    delete [] _probes;
+  }
+
+  /*
+   * Start probing each of the ports.  If several have answered by the
+   * time anyone looks, the earliest in the list wins.
+   */
+  BOOL Start(const TCHAR **ports, int count)
+  {
+    int i;
+
+    if (count <= 0) { return FALSE; }
+
+    _probes = new Probe[count];
+    _count = count;
+
+    for (i = 0; i < count; i++) {
+      Probe *probe = &_probes[i];
+
+      strcpy_t(probe->_port, _countof(probe->_port), ports[i]);
+      probe->_thread = CreateThread(NULL, 0, Probe::ProbeThread, probe, 0, NULL);
+      if (probe->_thread == NULL) { probe->_done = TRUE; }
+    }
+    return TRUE;
+  }
+
+  /*
+   * Index of first port a reader answered on, or -1.
+   */
+  int Found()
+  {
+    int i;
+
+    for (i = 0; i < _count; i++) {
+      if (_probes[i]._done && _probes[i]._found >= 0) { return i; }
+    }
+    return -1;
+  }
+
+  /*
+   * Wait up to timeout ms for a reader to answer, or for every port to
+   * give up.  Returns TRUE if one of those happened.
+   */
+  BOOL Wait(DWORD timeout)
+  {
+    DWORD start = GetTickCount();
+    int i;
+
+    while (1) {
+      if (Found() >= 0) { return TRUE; }
+      for (i = 0; i < _count; i++) {
+        if (_probes[i]._done == FALSE) { break; }
+      }
+      if (i == _count) { return TRUE; }
+      if (GetTickCount() - start >= timeout) { return FALSE; }
+      Sleep(IDLE_TIMEOUT / 4);
+    }
+  }
+
+  /*
+   * Stop any probes still running and wait for them to let go of their
+   * ports.
+   */
+  void Finish()
+  {
+    int i;
+
+    for (i = 0; i < _count; i++) { _probes[i].Stop(); }
+    for (i = 0; i < _count; i++) { _probes[i].Join(); }
+  }
+};
+
+#endif
@@ -0,0 +1,1174 @@
+#if !defined(_READER_H)
+#define _READER_H
+
+/*
+ * reader.h --
+ *
+ * Reader protocol: opening the serial port, talking to the CMD> shell
+ * and the 908 Boot> loader, and sending S-record files.
+ *
+ * Nothing in here touches a window, so several Readers can run side by
+ * side on their own threads (see gang.h).  Whoever owns a Reader gets
+ * its output, status and progress through the virtual hooks.
+ */
+
+#define IDLE_TIMEOUT            100
+#define CONSOLE_TIMEOUT         500
+
+#define CMD_TIMEOUT		500
+#define LINE_TIMEOUT		20
+#define LINE_WINDOW		1
+
+#define LINE_DELAY_MIN		2
+#define LINE_DELAY_MAX		100	/* Same limit as the serial settings dialog. */
+#define LINE_DELAY_MARGIN	5
+
+#define RESUME_TRIES		3
+#define MACRO_DEPTH		4
+#define MACRO_QUEUE		64	/* Commands and comments run ahead. */
+
+#define BAUD_REVERT		1000	/* Reader goes back to its old rate if not
+					   spoken to at the new one by then. */
+
+/*
+ * Bootloaders we know how to talk to.  The adaptive line delay is
+ * learned separately for each.
+ */
+enum { MODEL_CMD, MODEL_908, MODELS };
+
+enum { VERIFY_OK, VERIFY_FAILED, VERIFY_UNSUPPORTED, VERIFY_UNKNOWN /* Not asked yet. */ };
+
+struct TTY
+{
+  CommPort comm;
+  SerialConfig serial;
+  BOOL echo;
+  BOOL pause;
+  int lineDelay;
+  int window;           // S-record lines in flight; 1 is stop-and-wait.
+  BOOL adaptive;        // Tune line delay from reader response times.
+  int learned[MODELS];  // Line delay learned per model, or 0.
+  int recordSize;       // Merge data records up to this many bytes, or 0.
+  int macroDepth;       // Command file lines in flight; 1 is one at a time.
+  BOOL verify;          // Check the reader's CRC of the image afterwards.
+  BOOL skip;            // Leave readers that already hold the image alone.
+  DWORD maxBaud;        // Fastest rate to ask the reader for, or 0.
+  DWORD bestBaud;       // Fastest rate that worked on this port, or 0.
+};
+
+/*
+ * Adaptive line delay.  Tracks how long the reader takes to answer each
+ * line, the same way TCP tracks round trip time: a smoothed mean plus
+ * four times the mean deviation, plus a small margin.  The delay drops
+ * slowly towards that, rises to it at once, and doubles when the reader
+ * rejects a line, stays quiet, or holds us off with XOFF.
+ */
+struct LineDelay
+{
+  int _delay;		/* Current line delay, ms. */
+  int _srtt;		/* Smoothed response time, ms * 8, or -1 if none yet. */
+  int _var;		/* Mean deviation, ms * 4. */
+
+  static int Clamp(int delay)
+  {
+    if (delay < LINE_DELAY_MIN) { return LINE_DELAY_MIN; }
+    if (delay > LINE_DELAY_MAX) { return LINE_DELAY_MAX; }
+    return delay;
+  }
+
+  void Start(int delay)
+  {
+    _delay = Clamp(delay);
+    _srtt = -1;
+    _var = 0;
+  }
+
+  /*
+   * Reader answered a line after ms.
+   */
+  void Sample(int ms)
+  {
+    int err, target;
+
+    if (_srtt < 0) {
+      _srtt = ms * 8;
+      _var = ms * 2;
+    } else {
+      err = ms - _srtt / 8;
+      _srtt += err;
+      if (err < 0) { err = -err; }
+      _var += err - _var / 4;
+    }
+
+    target = Clamp(_srtt / 8 + _var + LINE_DELAY_MARGIN);
+    if (target > _delay) {
+      _delay = target;
+    } else {
+      _delay -= (_delay - target + 3) / 4;
+    }
+  }
+
+  void Backoff()
+  {
+    _delay = Clamp(_delay * 2);
+  }
+};
+
+#define MAX_PATTERNS		4
+#define MAX_PATTERN		128
+
+/*
+ * Looks for any of several patterns in a stream of bytes fed to it a
+ * piece at a time.  Each pattern has its own KMP automaton, so every
+ * byte is looked at once per pattern and nothing is ever rescanned.
+ */
+struct Matcher
+{
+  const char *_pat[MAX_PATTERNS];
+  int _len[MAX_PATTERNS];
+  int _fail[MAX_PATTERNS][MAX_PATTERN];	/* Longest proper border of pat[0..i]. */
+  int _state[MAX_PATTERNS];		/* Bytes of pattern matched so far. */
+  int _count;
+
+  /*
+   * Returns FALSE, matching nothing, if a pattern is longer than
+   * MAX_PATTERN; a prefix of it would match where it does not.
+   */
+  BOOL Init(const char **pats, int count)
+  {
+    int p, i, k;
+
+    _count = 0;
+    if (count > MAX_PATTERNS) { return FALSE; }
+    for (p = 0; p < count; p++) {
+      if (lstrlenA(pats[p]) > MAX_PATTERN) { return FALSE; }
+    }
+    _count = count;
+
+    for (p = 0; p < count; p++) {
+      const char *pat = pats[p];
+
+      _pat[p] = pat;
+      _len[p] = lstrlenA(pat);
+      _state[p] = 0;
+
+      _fail[p][0] = 0;
+      for (i = 1, k = 0; i < _len[p]; i++) {
+        while (k > 0 && pat[i] != pat[k]) { k = _fail[p][k - 1]; }
+        if (pat[i] == pat[k]) { k++; }
+        _fail[p][i] = k;
+      }
+    }
+    return TRUE;
+  }
+
+  /*
+   * Returns index of the first pattern completed within buf, or -1.
+   * If used is given, it is set to how many bytes were looked at, so
+   * the rest can be fed in again.  Every pattern has seen the same
+   * bytes, so feeding the rest carries on where each one left off.
+   */
+  int Feed(const char *buf, int len, int *used = NULL)
+  {
+    int i, p, k, found;
+
+    if (used != NULL) { *used = len; }
+    for (p = 0; (p < _count) && (len > 0); p++) {
+      if (_len[p] == 0) {
+        if (used != NULL) { *used = 0; }
+        return p;
+      }
+    }
+
+    for (i = 0; i < len; i++) {
+      char ch = buf[i];
+
+      found = -1;
+      for (p = 0; p < _count; p++) {
+        k = _state[p];
+        while (k > 0 && ch != _pat[p][k]) { k = _fail[p][k - 1]; }
+        if (ch == _pat[p][k]) { k++; }
+        if (k == _len[p]) {
+          k = 0;
+          if (found < 0) { found = p; }
+        }
+        _state[p] = k;
+      }
+      if (found >= 0) {
+        if (used != NULL) { *used = i + 1; }
+        return found;
+      }
+    }
+    return -1;
+  }
+};
+
+struct Reader
+{
+  TTY _tty;
+  volatile LONG _stop;  // Set by owner to cancel current operation.
+  int _errLine;         // Record the reader rejected, 0 if none, -1 if not known.
+  int _acked;           // Records of the last file the reader answered for.
+  DWORD _baud;          // Rate the port is at now.
+  int _model;           // MODEL_xxx of the bootloader being talked to.
+  TCHAR _cacheDir[MAX_PATH];  // Where last image per port is kept, or "" for no delta.
+  ReflashStats _stats;  // How the last Reflash() went.
+  MacroVars _vars;      // For PlayMacro(), e.g. unit.
+
+  Reader()
+  {
+    int i;
+
+    DefaultSerialConfig(&_tty.serial);
+    _tty.echo = FALSE;
+    _tty.pause = FALSE;
+    _tty.lineDelay = LINE_TIMEOUT;
+    _tty.window = LINE_WINDOW;
+    _tty.adaptive = TRUE;
+    _tty.recordSize = 0;
+    _tty.macroDepth = MACRO_DEPTH;
+    _tty.verify = FALSE;
+    _tty.skip = FALSE;
+    _tty.maxBaud = 0;
+    _tty.bestBaud = 0;
+    for (i = 0; i < MODELS; i++) { _tty.learned[i] = 0; }
+
+    _stop = FALSE;
+    _errLine = 0;
+    _acked = 0;
+    _baud = 0;
+    _model = MODEL_CMD;
+    _cacheDir[0] = '\0';
+  }
+
+  virtual ~Reader() {}
+
+  /*
+   * Cancel the current operation, from any thread.  Anything waiting
+   * on the port wakes up at once.
+   */
+  void Stop()
+  {
+    InterlockedExchange(&_stop, TRUE);
+    _tty.comm.Cancel();
+  }
+
+  /*
+   * Hooks for the owner.  These are called from whatever thread is
+   * running the Reader.
+   *
+   * Output - characters received from the reader.  buf may be modified
+   *      temporarily, but is restored before returning.
+   *
+   * Status - one-line description of what is happening, or an error.
+   *
+   * Progress - record of S-record image just sent.
+   */
+  virtual void Output(char *buf, int len) {}
+  virtual void Status(const TCHAR *msg, BOOL err = TRUE) {}
+  virtual void Progress(int line, int total) {}
+
+ /*
+  * Open and configure serial port.  On failure, GetLastError() says why.
+  */
+  BOOL Port_Open(const TCHAR *name)
+  {
+    DWORD err;
+
+    _tty.comm.Close();
+    if (_tty.comm.Open(name) == FALSE) { return FALSE; }
+
+    if (_tty.comm.Configure(&_tty.serial) == FALSE) {
+      err = GetLastError();
+      _tty.comm.Close();
+      SetLastError(err);
+      return FALSE;
+    }
+    _baud = _tty.serial.baud;
+    return TRUE;
+  }
+
+  /*
+   * Change the port's rate, leaving everything else as it was.
+   */
+  BOOL Port_SetBaud(DWORD baud)
+  {
+    SerialConfig cfg = _tty.serial;
+
+    cfg.baud = baud;
+    if (_tty.comm.Configure(&cfg) == FALSE) { return FALSE; }
+    _baud = baud;
+    return TRUE;
+  }
+
+  BOOL Port_Send(const char *buf, int len = -1)
+  {
+    if (_stop) { return FALSE; }
+    if (len < 0) { len = lstrlenA(buf); }
+
+    _stats.Sent(len);
+    return _tty.comm.Write(buf, len);
+  }
+
+  /*
+   * Read until one of the patterns appears, or a read times out.
+   * Every byte is looked at once, however much the reader says first,
+   * and NULs are just bytes.
+   *
+   * Returns index of the pattern that matched, or -1.
+   */
+  int Port_ExpectAny(const char **pats, int count)
+  {
+    char tmp[1000];
+    Matcher m;
+    int read, found;
+
+    m.Init(pats, count);
+    _tty.comm.SetTimeout(CMD_TIMEOUT, CMD_TIMEOUT);
+
+    while (1) {
+      read = _tty.comm.Read(tmp, sizeof(tmp) - 1);
+      if (_stop) { break; }
+      if (read <= 0) { break; }
+      _stats._bytesRecv += read;
+      tmp[read] = '\0';
+      Output(tmp, read);
+
+      found = m.Feed(tmp, read);
+      if (found >= 0) { return found; }
+    }
+    return -1;
+  }
+
+  BOOL Port_Expect(const char *pat)
+  {
+    return Port_ExpectAny(&pat, 1) == 0;
+  }
+
+  /*
+   * Let anything the reader is still saying go by, until it has been
+   * quiet for quiet ms, so the next reply starts clean.
+   */
+  void Port_Drain(int quiet)
+  {
+    char tmp[1000];
+    int read;
+
+    _tty.comm.SetTimeout(quiet, -1);
+    while (_stop == FALSE) {
+      read = _tty.comm.Read(tmp, sizeof(tmp) - 1);
+      if (read <= 0) { break; }
+      _stats._bytesRecv += read;
+      tmp[read] = '\0';
+      Output(tmp, read);
+    }
+  }
+
+  /*
+   * Send a command to the CMD> shell and keep what comes back, up to
+   * len - 1 characters of it, in reply.
+   *
+   * Returns TRUE if the prompt came back.
+   */
+  BOOL Port_Ask(const char *cmd, char *reply, int len)
+  {
+    static const char *prompt = "CMD>";
+    char tmp[1000];
+    Matcher m;
+    int read, used, n;
+
+    reply[0] = '\0';
+    used = 0;
+    m.Init(&prompt, 1);
+    _tty.comm.SetTimeout(CMD_TIMEOUT, CMD_TIMEOUT);
+    if (Port_Send(cmd) == FALSE) { return FALSE; }
+
+    while (1) {
+      read = _tty.comm.Read(tmp, sizeof(tmp) - 1);
+      if (_stop) { break; }
+      if (read <= 0) { break; }
+      _stats._bytesRecv += read;
+      tmp[read] = '\0';
+      Output(tmp, read);
+
+      n = min(read, len - 1 - used);
+      memcpy(reply + used, tmp, n);
+      used += n;
+      reply[used] = '\0';
+
+      if (m.Feed(tmp, read) >= 0) { return TRUE; }
+    }
+    return FALSE;
+  }
+
+  /*
+   * Check what the reader holds against the image, without sending it
+   * again.  For each run of contiguous data, "CRC addr len" at the CMD>
+   * prompt should answer "CRC=xxxxxxxx", the CRC-32 of what is there.
+   * A loader that answers the first with no CRC at all doesn't know the
+   * command.
+   *
+   * Returns VERIFY_xxx.  If VERIFY_FAILED, *bad is where the first range
+   * that did not match starts.
+   */
+  int Verify(const SRecordImage *image, DWORD *bad)
+  {
+    char cmd[40], reply[200];
+    const char *p;
+    int i;
+
+    // Spare prompts from getting the reader's attention.
+    Port_Drain(LINE_TIMEOUT);
+
+    for (i = 0; i < image->_rangeCount; i++) {
+      const SRecordRange *r = &image->_ranges[i];
+
+      *bad = r->addr;
+      StringCchPrintfA(cmd, _countof(cmd), "CRC %X %X\r", (unsigned) r->addr, (unsigned) r->len);
+      if (Port_Ask(cmd, reply, sizeof(reply)) == FALSE) { return VERIFY_FAILED; }
+
+      p = strstr(reply, "CRC=");
+      if (p == NULL) { return (i == 0) ? VERIFY_UNSUPPORTED : VERIFY_FAILED; }
+      if ((DWORD) strtoul(p + 4, NULL, 16) != r->crc) { return VERIFY_FAILED; }
+    }
+    return VERIFY_OK;
+  }
+
+  /*
+   * Whether the loader knows CRC at all, asked over one byte of image so
+   * it is quick whatever the reader holds.  Returns VERIFY_FAILED if no
+   * answer came.
+   */
+  int CanVerify(const SRecordImage *image)
+  {
+    char cmd[40], reply[200];
+
+    StringCchPrintfA(cmd, _countof(cmd), "CRC %X 1\r", (unsigned) image->_ranges[0].addr);
+    if (Port_Ask(cmd, reply, sizeof(reply)) == FALSE) { return VERIFY_FAILED; }
+    return (strstr(reply, "CRC=") != NULL) ? VERIFY_OK : VERIFY_UNSUPPORTED;
+  }
+
+  /*
+   * Name of the file in _cacheDir holding the image last programmed
+   * into the reader on this port.
+   */
+  BOOL CacheName(TCHAR *buf, int len)
+  {
+    TCHAR port[64];
+    int i;
+
+    if (_cacheDir[0] == '\0') { return FALSE; }
+
+    strcpy_t(port, _countof(port), _tty.comm.Name());
+    for (i = 0; port[i] != '\0'; i++) {
+      if (_tcschr(_T(":\\/."), port[i]) != NULL) { port[i] = '_'; }
+    }
+    sprintf_t(buf, len, _T("%s") PATH_SEP _T("%s.s19"), _cacheDir, port);
+    return TRUE;
+  }
+
+  /*
+   * Reflash the reader on the already opened port with the given
+   * S-record image.  Final result is reported through Status().
+   *
+   * If a cache dir is set, the image is remembered per port.  Next time
+   * the RF command is used, only records that changed are sent, but
+   * only if the reader shows, by the CRCs of what it holds, that it is
+   * still the one that took the remembered image, and verify is on to
+   * check the result.  If the changes alone fail verify, the whole
+   * image is sent once more.  The 908 loader always erases the whole
+   * part, so it always gets the lot.
+   *
+   * Unless _tty.verify is off, what the reader ends up holding is
+   * checked against the whole image (see Verify()).  Unless _tty.skip
+   * is off, the same check is made first, and a reader that already
+   * holds the image is left as it is.
+   *
+   * How long each step took is left in _stats.
+   *
+   * Returns TRUE if the reader was reflashed.
+   */
+  BOOL Reflash(const SRecordImage *image)
+  {
+    char tmp[128];
+    TCHAR err[64], summary[128], done[160];
+    TCHAR cache[MAX_PATH];
+    SRecordImage was, delta;
+    const SRecordImage *send = image;
+    int i, verified = VERIFY_UNKNOWN;
+    BOOL cached = FALSE;
+    DWORD bad;
+    const TCHAR *msg = NULL;
+
+    _stats.Start();
+    _stats._baud = _baud;
+
+    if ((image == NULL) || (image->_count == 0)) {
+      msg = _T("No S-records to send");
+      goto end;
+    }
+
+    // Until this reflash succeeds, the reader may not hold what the
+    // cache says, so drop it now.
+    if (CacheName(cache, _countof(cache))) {
+      cached = was.Load(cache);
+      DeleteFile(cache);
+    }
+
+    Status(_T("Connecting to reader..."), 0);
+
+    Port_Send("\r\r\r");
+    if (Port_Expect("CMD>")) {
+      // Ask before erasing anything: the reader may already have it.
+
+      if (_tty.skip) {
+        _stats.Phase(PHASE_VERIFY);
+        verified = Verify(image, &bad);
+        if (_stop) { goto end; }
+        if (verified == VERIFY_OK) {
+          if (_cacheDir[0] != '\0') { image->Save(cache); }
+          _stats.Stop();
+          Status(_T("Reader already has this image"), 0);
+          goto end;
+        }
+      }
+
+      // Someone may have put a different reader on this port since.
+      if (cached && _tty.verify && (verified != VERIFY_UNSUPPORTED)) {
+        _stats.Phase(PHASE_VERIFY);
+        verified = Verify(&was, &bad);
+        if (verified == VERIFY_OK) {
+          delta.Delta(image, &was);
+          send = &delta;
+        }
+        if (_stop) { goto end; }
+      }
+
+      // Try RF command.
+
+      _stats.Phase(PHASE_PROMPT);
+      if (_tty.maxBaud > _tty.serial.baud) { Negotiate(); }
+resend:
+      if (StartRF() == FALSE) {
+        _stats._retries++;
+        RestoreBaud();
+        goto try908;
+      }
+
+      _model = MODEL_CMD;
+      _stats.Phase(PHASE_PROGRAM);
+      if (SendFile(send) == FALSE && Resume(send, verified) == FALSE) { goto senderr; }
+      _stats.Phase(PHASE_REBOOT);
+    } else {
+      // Try 908
+
+try908:
+      _stats.Phase(PHASE_PROMPT);
+      memset(tmp, 27, sizeof(tmp));
+      tmp[sizeof(tmp) - 1] = '\0';
+
+      Port_Send(tmp);
+      Port_Expect("Boot>");
+
+      Port_Send("\r\n");
+
+      if (Port_Expect("Boot>") == FALSE) {
+        msg = _T("Reader didn't accept reflash command");
+        goto end;
+      }
+
+      _stats.Phase(PHASE_ERASE);
+      Port_Send("w");
+      Port_Expect("Boot>");
+      Port_Send("w");
+      if (Port_Expect("Boot>") == FALSE) {
+        msg = _T("Could not erase reader");
+        goto end;
+      }
+      Port_Send("p");
+      if (Port_Expect("...") == FALSE) {
+        msg = _T("Reader didn't accept program command");
+        goto end;
+      }
+      strcpy_tA(tmp, _countof(tmp), " downloading ...");
+      Output(tmp, -1);
+      _model = MODEL_908;
+      send = image;
+      _stats.Phase(PHASE_PROGRAM);
+      if (SendFile(send) == FALSE) { goto senderr; }
+      _stats.Phase(PHASE_REBOOT);
+      Port_Expect("Boot>");
+      Port_Send("x");
+    }
+
+    for (i = 0; i < 5; i++) {
+      if (Port_Expect("CMD>")) { break; }
+      _stats._retries++;
+    }
+
+    if (_stop) { goto end; }
+
+    // Don't ask again if it didn't know how the first time.
+    if (_tty.verify && (verified != VERIFY_UNSUPPORTED)) {
+      _stats.Phase(PHASE_VERIFY);
+      verified = Verify(image, &bad);
+      if (_stop) { goto end; }
+      if (verified == VERIFY_FAILED && send == &delta) {
+        Status(_T("Changes did not take, sending the whole image"), 0);
+        _stats._retries++;
+        send = image;
+        goto resend;
+      }
+      if (verified == VERIFY_FAILED) {
+        sprintf_t(err, _countof(err), _T("Reader failed verify at %X"), (unsigned) bad);
+        msg = err;
+        goto end;
+      }
+    }
+
+    if (_cacheDir[0] != '\0') { image->Save(cache); }
+    _stats.Stop();
+    _stats.Summary(summary, _countof(summary));
+    sprintf_t(done, _countof(done), _T("Reflash Complete%s: %s"),
+        (verified == VERIFY_UNSUPPORTED) ? _T(", not verified") : _T(""), summary);
+    Status(done, 0);
+    goto end;
+
+senderr:
+    msg = _T("Error sending file");
+    if (_errLine > 0) {
+      sprintf_t(err, _countof(err), _T("Reader rejected line %d of file"),
+          send->_recs[_errLine - 1].srcLine);
+      msg = err;
+    } else if (_errLine < 0) {
+      msg = _T("Reader rejected a line of file, which one is not known");
+    }
+
+end:
+    RestoreBaud();
+    _stats.Stop();
+    if (_stop) { msg = _T("Reflash Cancelled"); }
+
+    if (msg != NULL) { Status(msg); }
+
+    return (msg == NULL);
+  }
+
+  /*
+   * Send the image, keeping up to _tty.window lines in flight.
+   *
+   * With a window of 1, each line waits out the line delay for the
+   * reader's feedback before the next is sent.  With a bigger window,
+   * each line of feedback from the reader frees the oldest line in
+   * flight, and the line delay only runs out when the reader goes
+   * quiet, which frees everything sent so far.  XON/XOFF set up in
+   * Port_Open() holds Port_Send() back if the reader falls behind.
+   *
+   * Quiet only means the next line may go, not that the reader took
+   * the last: it may still be programming.  Only a line of feedback
+   * counts as the reader taking a record, and _acked is left at how
+   * many it did, for Resume().  A reader that says nothing per line
+   * leaves it at 0.
+   *
+   * In adaptive mode the line delay starts from what was learned for
+   * this model of reader last time, and what it ends up at is stored
+   * back for next time.
+   *
+   * A '?' from the reader is blamed on the first line it has not
+   * answered for, which is left in _errLine.  If it has answered none
+   * and more than one line is out, there is no telling which, and
+   * _errLine is -1.
+   */
+  BOOL SendFile(const SRecordImage *image)
+  {
+    int i, sent, done, acked, len, read, window;
+    const char *src;
+    char line[1000];
+    LineDelay delay;
+    DWORD sendTime = 0;
+    BOOL answered = FALSE;
+
+    _errLine = 0;
+    window = (_tty.window > 1) ? _tty.window : 1;
+
+    if (_tty.adaptive) {
+      delay.Start(_tty.learned[_model] > 0 ? _tty.learned[_model] : _tty.lineDelay);
+    } else {
+      delay._delay = _tty.lineDelay;
+    }
+    _tty.comm.SetTimeout(delay._delay, -1);
+
+    for (sent = done = acked = 0; done < image->_count; ) {
+      if (_stop) { goto err; }
+
+      while ((sent < image->_count) && (sent - done < window)) {
+        src = image->Line(sent, &len);
+        if (Port_Send(src, len) == FALSE) { goto err; }
+        // Once written, so a timed hook sees when it went out.
+        Progress(sent + 1, image->_count);
+        sent++;
+        _stats._lines++;
+
+        sendTime = GetTickCount();
+        answered = FALSE;
+        if (_tty.comm.Held()) {
+          _stats._stalls++;
+          if (_tty.adaptive) {
+            delay.Backoff();
+            _stats._backoffs++;
+            _tty.comm.SetTimeout(delay._delay, -1);
+          }
+        }
+      }
+
+      // Line delay + get whatever feedback from reader.
+      //
+      read = _tty.comm.Read(line, sizeof(line) - 1);
+      if (_stop) { goto err; }
+      if (read < 0) { goto err; }
+      if (read == 0) {
+        if (_tty.adaptive && !answered && (delay._srtt >= 0)) {
+          // Reader has been answering, but not this time.  Too hasty.
+          delay.Backoff();
+          _stats._backoffs++;
+          _tty.comm.SetTimeout(delay._delay, -1);
+        }
+        done = sent;
+        continue;
+      }
+
+      _stats._bytesRecv += read;
+      if (!answered) {
+        DWORD ms = GetTickCount() - sendTime;
+
+        answered = TRUE;
+        _stats.Latency(ms);
+        if (_tty.adaptive) {
+          delay.Sample((int) ms);
+          _tty.comm.SetTimeout(delay._delay, -1);
+        }
+      }
+
+      line[read] = '\0';
+      Output(line, read);
+      for (i = 0; i < read; i++) {
+        if (line[i] == '?') {
+          _errLine = (acked > 0 || sent - acked == 1) ? acked + 1 : -1;
+          if (_tty.adaptive) { _tty.learned[_model] = LineDelay::Clamp(delay._delay * 2); }
+          goto err;
+        }
+        if ((line[i] == '\n') && (acked < sent)) {
+          acked++;
+          if ((window > 1) && (done < acked)) { done = acked; }
+        }
+      }
+    }
+
+    if (_tty.adaptive) { _tty.learned[_model] = delay._delay; }
+    _acked = acked;
+    return TRUE;
+
+err:
+    _acked = acked;
+    Port_Send("\r\n\r\n");
+    return FALSE;
+  }
+
+  /*
+   * At the CMD> prompt, ask the RF loader for a file.
+   */
+  BOOL StartRF()
+  {
+    Port_Send("RF\r");
+    if (Port_Expect("Send File") == FALSE) { return FALSE; }
+    Port_Expect(">");
+    return TRUE;
+  }
+
+  /*
+   * At the CMD> prompt, move the link up to the fastest rate the reader
+   * will take, up to _tty.maxBaud.  "BAUD n" answered with OK means the
+   * reader has switched once the prompt is out; a prompt back at the
+   * new rate settles it.  If that doesn't come, the reader goes back to
+   * the old rate after BAUD_REVERT, and the next rate down is tried.
+   *
+   * The rate that worked last time on this port, _tty.bestBaud, is
+   * tried first, and whatever works is left there.
+   */
+  void Negotiate()
+  {
+    static const DWORD rates[] = { 921600, 460800, 230400 };
+    DWORD tries[_countof(rates) + 1];
+    char cmd[32], reply[200];
+    int i, n = 0;
+
+    if (_tty.bestBaud > _tty.serial.baud && _tty.bestBaud <= _tty.maxBaud) {
+      tries[n++] = _tty.bestBaud;
+    }
+    for (i = 0; i < (int) _countof(rates); i++) {
+      if (rates[i] <= _tty.maxBaud && rates[i] > _tty.serial.baud && rates[i] != _tty.bestBaud) {
+        tries[n++] = rates[i];
+      }
+    }
+
+    Port_Drain(LINE_TIMEOUT);
+
+    for (i = 0; (i < n) && (_stop == FALSE); i++) {
+      StringCchPrintfA(cmd, _countof(cmd), "BAUD %u\r", (unsigned) tries[i]);
+      if (Port_Ask(cmd, reply, sizeof(reply)) == FALSE) { break; }
+      if (strstr(reply, "OK") == NULL) { continue; }   // Not this rate.
+
+      if (Port_SetBaud(tries[i])) {
+        Port_Send("\r");
+        if (Port_Expect("CMD>")) {
+          _tty.bestBaud = tries[i];
+          _stats._baud = tries[i];
+          return;
+        }
+      }
+
+      // Lost it.  Wait for the reader to give up too and find it again.
+      _stats._retries++;
+      Port_SetBaud(_tty.serial.baud);
+      if (_tty.comm.Pause(BAUD_REVERT) == FALSE) { break; }
+      Port_Send("\r");
+      if (Port_Expect("CMD>") == FALSE) { break; }
+    }
+    _tty.bestBaud = 0;
+  }
+
+  /*
+   * Bring the link back to the usual rate, if Negotiate() moved it.
+   */
+  void RestoreBaud()
+  {
+    char cmd[32], reply[200];
+
+    if (_baud == _tty.serial.baud || _tty.comm.IsOpen() == FALSE) { return; }
+
+    StringCchPrintfA(cmd, _countof(cmd), "BAUD %u\r", (unsigned) _tty.serial.baud);
+    Port_Ask(cmd, reply, sizeof(reply));
+    Port_SetBaud(_tty.serial.baud);
+    Port_Send("\r");
+    Port_Expect("CMD>");
+  }
+
+  /*
+   * Pick up an RF transfer that SendFile() gave up on, from the first
+   * record the reader did not take, rather than starting over.  The RF
+   * loader programs whatever well-formed file it is sent, so the rest
+   * of the image goes as a file of its own.  The 908 loader must erase
+   * before it programs, so it gets no such second chance.
+   *
+   * It starts from the first record the reader did not answer for,
+   * which for a reader that answers nothing is the start of the file.
+   * A record wrongly taken as done would only show up in Verify(), so
+   * without that there is no resuming.  verified is what Reflash() has
+   * learned so far, VERIFY_UNKNOWN if it has not asked.
+   *
+   * Gives up after RESUME_TRIES, each from wherever the last one got
+   * to.  On failure, _errLine is the record of image last rejected.
+   */
+  BOOL Resume(const SRecordImage *image, int verified)
+  {
+    SRecordImage rest;
+    TCHAR tmp[64];
+    int *index;
+    int tries, from, errLine;
+    BOOL ok = FALSE;
+
+    if (_tty.verify == FALSE || verified == VERIFY_UNSUPPORTED) {
+      Status(_T("Cannot verify the reader, so not resuming"), 0);
+      return FALSE;
+    }
+
+    index = new int[image->_count + 1];
+    from = min(_acked, image->_count - 1);
+    errLine = _errLine;
+
+    for (tries = 0; (tries < RESUME_TRIES) && (_stop == FALSE); tries++) {
+      if (tries > 0 && _tty.comm.Pause(CMD_TIMEOUT) == FALSE) { break; }
+      _stats._retries++;
+
+      Port_Drain(LINE_TIMEOUT);
+      Port_Send("\r\r\r");
+      if (Port_Expect("CMD>") == FALSE) { continue; }
+
+      if (verified == VERIFY_UNKNOWN) {
+        // What was in flight comes back as bad commands; let it pass
+        // so the CRC answer is not taken from one of those.  Only
+        // whether it can verify matters here: the image is half sent.
+        Port_Drain(CMD_TIMEOUT);
+        verified = CanVerify(image);
+        if (verified == VERIFY_UNSUPPORTED) {
+          Status(_T("Cannot verify the reader, so not resuming"), 0);
+          break;
+        }
+        if (_stop) { break; }
+        if (verified == VERIFY_FAILED) {
+          verified = VERIFY_UNKNOWN;
+          continue;
+        }
+      }
+
+      sprintf_t(tmp, _countof(tmp), _T("Resuming from line %d"), image->_recs[from].srcLine);
+      Status(tmp, 0);
+      if (StartRF() == FALSE) { continue; }
+
+      rest.Rest(image, from, index);
+      if (SendFile(&rest)) {
+        ok = TRUE;
+        break;
+      }
+
+      if (_errLine != 0) { errLine = (_errLine > 0) ? index[_errLine - 1] + 1 : -1; }
+      if (_acked > 0 && index[_acked - 1] + 1 > from) {
+        from = min(index[_acked - 1] + 1, image->_count - 1);
+      }
+    }
+
+    _errLine = ok ? 0 : errLine;
+    delete [] index;
+    return ok;
+  }
+
+  /*
+   * Send command op of a command file with its variables in.
+   */
+  BOOL MacroSend(MacroRun *run, int op)
+  {
+    char line[MACRO_LINE + 1];
+    int len;
+
+    if (run->Expand(run->_macro->_ops[op].text, line, MACRO_LINE) == FALSE) { return FALSE; }
+    len = lstrlenA(line);
+    line[len++] = '\r';
+    return Port_Send(line, len);
+  }
+
+  /*
+   * Show the comments at the front of the queue as if the shell had
+   * answered them.
+   */
+  void MacroComments(MacroRun *run, const int *queue, int *head, int *count)
+  {
+    char line[MACRO_LINE + 8];
+    const MacroOp *op;
+
+    while (*count > 0) {
+      op = &run->_macro->_ops[queue[*head]];
+      if (op->op != MACRO_COMMENT) { break; }
+      if (run->Expand(op->text, line, MACRO_LINE) == FALSE) {
+        strcpy_tA(line, MACRO_LINE, run->_macro->Text(op->text));
+      }
+      strcat_tA(line, _countof(line), "\r\nCMD>");
+      Output(line, -1);
+      *head = (*head + 1) % MACRO_QUEUE;
+      (*count)--;
+    }
+  }
+
+  /*
+   * Carry out the directive at run->_pc, once everything before it has
+   * been answered.
+   */
+  BOOL MacroDirective(MacroRun *run)
+  {
+    const MacroOp *op = run->Op();
+    char text[MACRO_LINE + 2], reply[MACRO_REPLY], tmp[1000];
+    const char *pat = text;
+    DWORD start;
+    Matcher m;
+    int ms, read, n, len;
+
+    if (op->op == MACRO_ECHO) {
+      if (run->Expand(op->text, text, MACRO_LINE) == FALSE) { return FALSE; }
+      strcat_tA(text, _countof(text), "\r\n");
+      Output(text, -1);
+    } else if (op->op == MACRO_WAIT) {
+      if (run->Number(op->text, &ms) == FALSE) { return FALSE; }
+      _tty.comm.Pause(ms);
+    } else if (op->op == MACRO_EXPECT) {
+      if (run->Expand(op->text, text, MACRO_LINE) == FALSE) { return FALSE; }
+      ms = run->_timeout;
+      if (op->arg >= 0 && run->Number(op->arg, &ms) == FALSE) { return FALSE; }
+
+      if (m.Init(&pat, 1) == FALSE) {
+        return run->Error(_T("\"%") PRI_AS _T("\" is longer than %d characters"), text, MAX_PATTERN);
+      }
+      len = 0;
+      reply[0] = '\0';
+      for (start = GetTickCount(); ; ) {
+        n = ms - (int) (GetTickCount() - start);
+        if (n <= 0) { break; }
+        _tty.comm.SetTimeout(n, n);
+        read = _tty.comm.Read(tmp, sizeof(tmp) - 1);
+        if (_stop || read <= 0) { break; }
+        _stats._bytesRecv += read;
+        tmp[read] = '\0';
+        Output(tmp, read);
+
+        n = min(read, MACRO_REPLY - 1 - len);
+        memcpy(reply + len, tmp, n);
+        len += n;
+        reply[len] = '\0';
+        if (m.Feed(tmp, read) >= 0) {
+          run->Answer(reply, "");
+          run->_pc++;
+          return TRUE;
+        }
+      }
+      if (_stop) { return FALSE; }
+      return run->Error(_T("no \"%") PRI_AS _T("\" from reader"), text);
+    } else {
+      return run->Step();
+    }
+
+    run->_pc++;
+    return TRUE;
+  }
+
+  /*
+   * Play a command file into the CMD> shell (see macro.h).  Commands
+   * are sent up to _tty.macroDepth ahead, and each prompt that comes
+   * back finishes the oldest one still out, so the file is not held up
+   * by a round trip per line.  Comments are shown in their turn; any
+   * other directive waits until everything before it is answered.
+   *
+   * _vars holds what the caller has set, such as $unit; $port is set
+   * here.  An "Error" or "Unknown command" before a command's prompt
+   * rejects it: it is sent again if .retry allows, otherwise nothing
+   * more is sent.  Final result is reported through Status().
+   *
+   * Returns TRUE if the whole file ran.
+   */
+  BOOL PlayMacro(const TCHAR *fileName)
+  {
+    static const char *answers[] = { "CMD>", "Error", "ERROR", "Unknown command" };
+    const TCHAR *msg = NULL;
+    TCHAR err[64];
+    char tmp[1000], reply[MACRO_REPLY], cmd[MACRO_LINE];
+    int queue[MACRO_QUEUE];	// Commands out and comments to show, oldest first.
+    const char *src;
+    const MacroOp *op;
+    Macro macro;
+    MacroRun run(&macro, &_vars, CMD_TIMEOUT);
+    Matcher m;
+    int head, count, out, depth, tries, read, used, found, len, n;
+    BOOL rejected;
+
+    Status(_T("Playing command file..."), 0);
+
+    if (macro.Load(fileName) == FALSE) {
+      msg = macro._error;
+      goto end;
+    }
+    if (_vars.Get("unit") == NULL) { _vars.Set("unit", "1"); }
+    StringCchPrintfA(tmp, _countof(tmp), "%" PRI_TS, _tty.comm.Name());
+    _vars.Set("port", tmp);
+
+    Port_Send("\r\r\r");
+    if (Port_Expect("CMD>") == FALSE) {
+      msg = _T("No Reader detected");
+      goto end;
+    }
+    // Spare prompts would answer commands not yet sent.
+    Port_Drain(LINE_TIMEOUT);
+
+    m.Init(answers, _countof(answers));
+    head = count = out = tries = len = 0;
+    rejected = FALSE;
+
+    while (1) {
+      // Run ahead up to the next directive, .retry going one at a time.
+      depth = (_tty.macroDepth > 1 && run._retry == 0) ? _tty.macroDepth : 1;
+      while ((op = run.Op()) != NULL && count < MACRO_QUEUE) {
+        if (op->op == MACRO_SEND) {
+          if (out >= depth) { break; }
+          if (MacroSend(&run, run._pc) == FALSE) { goto fail; }
+          out++;
+        } else if (op->op != MACRO_COMMENT) {
+          break;
+        }
+        queue[(head + count++) % MACRO_QUEUE] = run._pc++;
+      }
+      MacroComments(&run, queue, &head, &count);
+
+      if (count == 0) {
+        if (run.Op() == NULL) { break; }
+        if (MacroDirective(&run) == FALSE) { goto fail; }
+        continue;
+      }
+
+      _tty.comm.SetTimeout(run._timeout, run._timeout);
+      read = _tty.comm.Read(tmp, sizeof(tmp) - 1);
+      if (_stop) { goto end; }
+      if (read <= 0) {
+        if (tries < run._retry) {
+          tries++;
+          len = 0;
+          if (MacroSend(&run, queue[head]) == FALSE) { goto fail; }
+          continue;
+        }
+        sprintf_t(err, _countof(err), _T("No answer to line %d of command file"),
+            macro._ops[queue[head]].srcLine);
+        msg = err;
+        goto end;
+      }
+      _stats._bytesRecv += read;
+      tmp[read] = '\0';
+      Output(tmp, read);
+
+      for (src = tmp; read > 0; src += used, read -= used) {
+        found = m.Feed(src, read, &used);
+        n = min(used, MACRO_REPLY - 1 - len);
+        memcpy(reply + len, src, n);
+        len += n;
+        if (found < 0) { break; }
+        if (found > 0) {
+          rejected = TRUE;
+          continue;
+        }
+        if (out == 0) { continue; }
+
+        // Prompt: the oldest command out is answered.
+        reply[len] = '\0';
+        len = 0;
+        if (rejected) {
+          rejected = FALSE;
+          if (tries < run._retry) {
+            tries++;
+            if (MacroSend(&run, queue[head]) == FALSE) { goto fail; }
+            continue;
+          }
+          sprintf_t(err, _countof(err), _T("Reader rejected line %d of command file"),
+              macro._ops[queue[head]].srcLine);
+          msg = err;
+          goto end;
+        }
+
+        run.Expand(macro._ops[queue[head]].text, cmd, _countof(cmd));
+        run.Answer(reply, cmd);
+        head = (head + 1) % MACRO_QUEUE;
+        count--;
+        out--;
+        tries = 0;
+        MacroComments(&run, queue, &head, &count);
+      }
+    }
+
+    Status(_T("Command file done"), 0);
+    goto end;
+
+fail:
+    if (_stop == FALSE) { msg = run._error; }
+
+end:
+    if (_stop) { msg = _T("Command file cancelled"); }
+    if (msg != NULL) { Status(msg); }
+
+    return (msg == NULL);
+  }
+};
+
+#endif
@@ -0,0 +1,540 @@
+/*
+* readersim.cpp --
+*
+* Simulated reader, for measuring and regression testing the reflash
+* path without hardware.  Opens a pty, prints the name of its slave end
+* and then behaves like a reader on the far end of that port:
+*
+*   CMD> shell    "\r" gives the prompt back, RF answers "Send File>"
+*                 and takes an S-record file, one "\r\n" per line.
+*   Boot> menu    ESC drops to the 908 bootloader; w erases, p takes an
+*                 S-record file, x goes back to the CMD> shell.
+*
+* A line with a bad checksum gets a '?' and the rest of the file is
+* thrown away, as on a real reader.  Every byte each way is paced as if
+* it went over a wire at --baud, and each record takes --flash-ms to
+* program.  While a record is programming, input piling up past
+* --rx-buffer bytes is held back with XOFF.
+*
+* What is programmed is kept, and "CRC addr len" at the CMD> prompt
+* answers "CRC=xxxxxxxx", the CRC-32 of what is there (erased flash
+* reads 0xff), unless --no-crc.
+*
+* "BAUD n" answers OK and moves to rate n, up to --max-baud (0 for no
+* such command).  Unless spoken to at the new rate within a second, it
+* goes back to the old one.  --baud-fail makes the new rate never work.
+*
+* "RESET" restarts the shell: a banner, a pause of --erase-ms, and the
+* prompt again.
+*
+* Faults to inject: reject a given record (--reject N) or a random
+* share of them (--reject-rate PCT), swallow the acknowledgement of a
+* random share (--drop-rate PCT), or quietly program a given record
+* wrong (--corrupt N).  --seed makes runs repeatable.
+*
+* One line per file received goes to stderr:
+*
+*   sim file RECORDS BYTES MS ok|rejected LINE
+*
+* Linux:   g++ -O2 -o readersim readersim.cpp -lutil
+*/
+
+#include "compat.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#include "srecord.h"
+
+#define SIM_LINE        1024
+#define SIM_ESC         27
+#define SIM_XON         0x11
+#define SIM_XOFF        0x13
+
+#define SIM_PAGE        65536
+#define SIM_PAGES       256     /* 16 MB of flash. */
+
+enum { SIM_CMD, SIM_BOOT, SIM_FILE, SIM_BOOTFILE };
+
+struct Sim
+{
+  int _fd;              /* Master end of the pty. */
+  int _mode;
+  char _line[SIM_LINE];
+  int _len;
+  BOOL _overflow;       /* Line longer than _line, rejected at end. */
+  BOOL _held;           /* Sent XOFF, no XON yet. */
+
+  // Settings.
+  DWORD _baud;          /* 0 for no pacing. */
+  int _flashMs, _eraseMs;
+  int _rxBuffer;
+  BOOL _has908;
+  BOOL _hasRF;
+  int _reject;          /* Reject this record of each file, or 0. */
+  int _rejectRate, _dropRate;
+  int _corrupt;         /* Program this record of each file wrong, or 0. */
+  BOOL _hasCRC;
+  DWORD _maxBaud;
+  BOOL _baudFail;
+  BOOL _once;
+
+  DWORD _oldBaud;
+  BOOL _switched;       /* Rate changed and not yet settled. */
+  DWORD _switchTime;
+
+  byte *_pages[SIM_PAGES];      /* Flash, or NULL where erased. */
+
+  // This file.
+  int _records;
+  long _bytes;
+  DWORD _start;
+
+  volatile BOOL _quit;
+
+  Sim()
+  {
+    int i;
+
+    _fd = -1;
+    _mode = SIM_CMD;
+    _len = 0;
+    _overflow = _held = FALSE;
+    _baud = 115200;
+    _flashMs = 2;
+    _eraseMs = 200;
+    _rxBuffer = 256;
+    _has908 = _hasRF = TRUE;
+    _reject = _rejectRate = _dropRate = 0;
+    _corrupt = 0;
+    _hasCRC = TRUE;
+    _maxBaud = 921600;
+    _baudFail = FALSE;
+    _once = FALSE;
+    _oldBaud = 0;
+    _switched = FALSE;
+    _switchTime = 0;
+    for (i = 0; i < SIM_PAGES; i++) { _pages[i] = NULL; }
+    _records = 0;
+    _bytes = 0;
+    _start = 0;
+    _quit = FALSE;
+  }
+
+  void Erase()
+  {
+    int i;
+
+    for (i = 0; i < SIM_PAGES; i++) {
+      delete [] _pages[i];
+      _pages[i] = NULL;
+    }
+  }
+
+  void Poke(DWORD addr, byte b)
+  {
+    DWORD page = addr / SIM_PAGE;
+
+    if (page >= SIM_PAGES) { return; }
+    if (_pages[page] == NULL) {
+      _pages[page] = new byte[SIM_PAGE];
+      memset(_pages[page], 0xff, SIM_PAGE);
+    }
+    _pages[page][addr % SIM_PAGE] = b;
+  }
+
+  DWORD Crc(DWORD addr, DWORD len)
+  {
+    byte ff[256];
+    DWORD crc = 0, page, n;
+
+    memset(ff, 0xff, sizeof(ff));
+    for (; len > 0; addr += n, len -= n) {
+      page = addr / SIM_PAGE;
+      n = min(len, SIM_PAGE - addr % SIM_PAGE);
+      if (page < SIM_PAGES && _pages[page] != NULL) {
+        crc = SRecordImage::Crc32(crc, _pages[page] + addr % SIM_PAGE, n);
+      } else {
+        n = min(n, (DWORD) sizeof(ff));
+        crc = SRecordImage::Crc32(crc, ff, n);
+      }
+    }
+    return crc;
+  }
+
+  /*
+   * Wire time for len characters, 10 bits each.
+   */
+  void Pace(int len)
+  {
+    if (_baud > 0) { usleep((useconds_t) ((long long) len * 10 * 1000000 / _baud)); }
+  }
+
+  void Say(const char *msg)
+  {
+    int len = lstrlenA(msg);
+
+    Pace(len);
+    if (write(_fd, msg, len) != len) { _quit = TRUE; }
+  }
+
+  void Flow(BOOL hold)
+  {
+    char ch = hold ? SIM_XOFF : SIM_XON;
+
+    if (hold == _held) { return; }
+    _held = hold;
+    if (write(_fd, &ch, 1) != 1) { _quit = TRUE; }
+  }
+
+  /*
+   * Program one record, holding the sender back if too much piles up
+   * meanwhile.
+   */
+  void Flash()
+  {
+    int queued = 0;
+
+    if (_flashMs > 0) { usleep(_flashMs * 1000); }
+    if (_rxBuffer > 0 && ioctl(_fd, FIONREAD, &queued) == 0) {
+      if (queued >= _rxBuffer) {
+        Flow(TRUE);
+      } else if (queued <= _rxBuffer / 4) {
+        Flow(FALSE);
+      }
+    }
+  }
+
+  static BOOL Roll(int pct)
+  {
+    return (pct > 0) && (rand() % 100 < pct);
+  }
+
+  /*
+   * Program the data of a checked record.
+   */
+  void Program(const char *p)
+  {
+    int type = p[1] - '0';
+    int count = SRecordImage::HexByte(p + 2);
+    int n = SRecordImage::AddrSize(type);
+    DWORD addr = 0;
+    int i;
+    byte b;
+
+    if (!SRecordImage::IsData(type)) { return; }
+    for (i = 0; i < n; i++) { addr = (addr << 8) | SRecordImage::HexByte(p + 4 + i * 2); }
+    for (i = n; i < count - 1; i++) {
+      b = (byte) SRecordImage::HexByte(p + 4 + i * 2);
+      if (_records == _corrupt && i == n) { b ^= 0x01; }
+      Poke(addr++, b);
+    }
+  }
+
+  /*
+   * Check one S-record line, as the reader would before programming it.
+   */
+  static BOOL Valid(const char *p, int len)
+  {
+    int i, count, sum, b;
+
+    if (len < 4 || p[0] != 'S' || p[1] < '0' || p[1] > '9') { return FALSE; }
+    if (SRecordImage::AddrSize(p[1] - '0') == 0) { return FALSE; }
+
+    count = SRecordImage::HexByte(p + 2);
+    if (count < 0 || len != 4 + count * 2) { return FALSE; }
+
+    sum = count;
+    for (i = 0; i < count; i++) {
+      b = SRecordImage::HexByte(p + 4 + i * 2);
+      if (b < 0) { return FALSE; }
+      sum += b;
+    }
+    return (sum & 0xff) == 0xff;
+  }
+
+  void EndFile(BOOL ok)
+  {
+    fprintf(stderr, "sim file %d %ld %u %s %d\n", _records, _bytes,
+        GetTickCount() - _start, ok ? "ok" : "rejected", ok ? 0 : _records);
+    fflush(stderr);
+
+    Flow(FALSE);
+    if (_mode == SIM_BOOTFILE) {
+      _mode = SIM_BOOT;
+      Say("\r\nBoot>");
+    } else {
+      _mode = SIM_CMD;
+      Say("\r\nCMD>");
+    }
+    if (_once && ok) { _quit = TRUE; }
+  }
+
+  void FileLine()
+  {
+    int type;
+
+    if (_len == 0) { return; }
+
+    _records++;
+    _bytes += _len + 2;
+
+    if (_overflow || Valid(_line, _len) == FALSE
+        || _records == _reject || Roll(_rejectRate)) {
+      Say("?");
+      EndFile(FALSE);
+      return;
+    }
+
+    Program(_line);
+    Flash();
+
+    type = _line[1] - '0';
+    if (type >= 7 && type <= 9) {
+      EndFile(TRUE);
+      return;
+    }
+    if (Roll(_dropRate) == FALSE) { Say("\r\n"); }
+  }
+
+  void StartFile(int mode)
+  {
+    _mode = mode;
+    _records = 0;
+    _bytes = 0;
+    _start = GetTickCount();
+  }
+
+  void CmdLine()
+  {
+    char tmp[40];
+    unsigned addr, len, rate;
+
+    _line[_len] = '\0';
+    StrTrimA(_line, " \t");
+
+    if (_line[0] == '\0') {
+      Say("\r\nCMD>");
+    } else if (_hasCRC && sscanf(_line, "CRC %x %x", &addr, &len) == 2) {
+      sprintf_t(tmp, sizeof(tmp), "\r\nCRC=%08X\r\nCMD>", (unsigned) Crc(addr, len));
+      Say(tmp);
+    } else if (_maxBaud > 0 && sscanf(_line, "BAUD %u", &rate) == 1) {
+      if (rate == 0 || rate > _maxBaud) {
+        Say("\r\nBad rate\r\nCMD>");
+      } else {
+        Say("\r\nOK\r\nCMD>");
+        _oldBaud = _baud;
+        _baud = rate;
+        _switched = TRUE;
+        _switchTime = GetTickCount();
+      }
+    } else if (lstrcmpi(_line, "RESET") == 0) {
+      Say("\r\nRestarting...\r\n");
+      if (_eraseMs > 0) { usleep(_eraseMs * 1000); }
+      Say("\r\nCMD>");
+    } else if (_hasRF && lstrcmpi(_line, "RF") == 0) {
+      Say("\r\nSend File>");
+      StartFile(SIM_FILE);
+    } else {
+      Say("\r\nUnknown command\r\nCMD>");
+    }
+  }
+
+  void BootKey(char ch)
+  {
+    switch (ch) {
+    case '\r':
+      Say("\r\nBoot>");
+      break;
+    case 'w':
+      Erase();
+      if (_eraseMs > 0) { usleep(_eraseMs * 1000); }
+      Say("\r\nBoot>");
+      break;
+    case 'p':
+      Say("\r\nProgramming...");
+      StartFile(SIM_BOOTFILE);
+      break;
+    case 'x':
+      _mode = SIM_CMD;
+      Say("\r\nCMD>");
+      break;
+    }
+  }
+
+  void Feed(char ch)
+  {
+    if (_switched) {
+      if (_baudFail) { return; }
+      _switched = FALSE;
+    }
+
+    if (ch == SIM_ESC) {
+      if (_has908 && _mode != SIM_BOOT) {
+        _mode = SIM_BOOT;
+        _len = 0;
+        Say("\r\nBoot>");
+      }
+      return;
+    }
+
+    if (_mode == SIM_BOOT) {
+      BootKey(ch);
+      return;
+    }
+
+    if (ch == '\r' || ch == '\n') {
+      if (_mode == SIM_CMD) {
+        if (ch == '\r') { CmdLine(); }
+      } else {
+        FileLine();
+      }
+      _len = 0;
+      _overflow = FALSE;
+      return;
+    }
+
+    if (_len < SIM_LINE - 1) {
+      _line[_len++] = ch;
+    } else {
+      _overflow = TRUE;
+    }
+  }
+
+  void Run()
+  {
+    char buf[256];
+    struct pollfd p;
+    int i, n;
+
+    p.fd = _fd;
+    p.events = POLLIN;
+
+    while (_quit == FALSE) {
+      if (_switched && GetTickCount() - _switchTime >= 1000) {
+        _baud = _oldBaud;
+        _switched = FALSE;
+      }
+      if (poll(&p, 1, 100) <= 0) { continue; }
+      n = (int) read(_fd, buf, sizeof(buf));
+      if (n <= 0) { break; }
+      Pace(n);
+      for (i = 0; i < n && _quit == FALSE; i++) { Feed(buf[i]); }
+    }
+  }
+};
+
+static Sim sim;
+
+static void
+OnBreak(int sig)
+{
+  sim._quit = TRUE;
+}
+
+static int
+Usage()
+{
+  fprintf(stderr,
+      "usage: readersim [--baud N] [--flash-ms MS] [--erase-ms MS]\n"
+      "         [--rx-buffer BYTES] [--model cmd|908|both] [--reject N]\n"
+      "         [--reject-rate PCT] [--drop-rate PCT] [--corrupt N]\n"
+      "         [--no-crc] [--max-baud N] [--baud-fail] [--seed N]\n"
+      "         [--link PATH] [--once]\n");
+  return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *link = NULL;
+  struct termios tio;
+  int slave, i;
+
+  srand(1);
+
+  for (i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+    if (lstrcmpi(arg, "--once") == 0) {
+      sim._once = TRUE;
+      continue;
+    }
+    if (lstrcmpi(arg, "--no-crc") == 0) {
+      sim._hasCRC = FALSE;
+      continue;
+    }
+    if (lstrcmpi(arg, "--baud-fail") == 0) {
+      sim._baudFail = TRUE;
+      continue;
+    }
+    if (val == NULL) { return Usage(); }
+    i++;
+
+    if (lstrcmpi(arg, "--baud") == 0) {
+      sim._baud = (DWORD) atoi(val);
+    } else if (lstrcmpi(arg, "--flash-ms") == 0) {
+      sim._flashMs = atoi(val);
+    } else if (lstrcmpi(arg, "--erase-ms") == 0) {
+      sim._eraseMs = atoi(val);
+    } else if (lstrcmpi(arg, "--rx-buffer") == 0) {
+      sim._rxBuffer = atoi(val);
+    } else if (lstrcmpi(arg, "--model") == 0) {
+      sim._hasRF = (lstrcmpi(val, "908") != 0);
+      sim._has908 = (lstrcmpi(val, "cmd") != 0);
+    } else if (lstrcmpi(arg, "--reject") == 0) {
+      sim._reject = atoi(val);
+    } else if (lstrcmpi(arg, "--reject-rate") == 0) {
+      sim._rejectRate = atoi(val);
+    } else if (lstrcmpi(arg, "--drop-rate") == 0) {
+      sim._dropRate = atoi(val);
+    } else if (lstrcmpi(arg, "--max-baud") == 0) {
+      sim._maxBaud = (DWORD) atoi(val);
+    } else if (lstrcmpi(arg, "--corrupt") == 0) {
+      sim._corrupt = atoi(val);
+    } else if (lstrcmpi(arg, "--seed") == 0) {
+      srand((unsigned) atoi(val));
+    } else if (lstrcmpi(arg, "--link") == 0) {
+      link = val;
+    } else {
+      return Usage();
+    }
+  }
+
+  if (openpty(&sim._fd, &slave, NULL, NULL, NULL) != 0) {
+    perror("openpty");
+    return 1;
+  }
+
+  // Raw until the host sets the port up.  Keeping the slave open means
+  // the host can close and reopen it between sessions.
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  if (link != NULL) {
+    unlink(link);
+    if (symlink(ttyname(slave), link) != 0) {
+      perror("symlink");
+      return 1;
+    }
+  }
+
+  printf("%s\n", ttyname(slave));
+  fflush(stdout);
+
+  signal(SIGINT, OnBreak);
+  signal(SIGTERM, OnBreak);
+
+  sim.Run();
+
+  if (link != NULL) { unlink(link); }
+  close(slave);
+  close(sim._fd);
+  return 0;
+}
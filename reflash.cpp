@@ -0,0 +1,407 @@
+/*
+* reflash.cpp --
+*
+* Headless reflash tool.  Runs the same Reader core as the console
+* dialog, straight from the command line, so production scripts can
+* drive readers without the GUI:
+*
+*   reflash --port COM3: --image reader.s19 [--macro setup.txt]
+*
+* Progress and results go to stdout one per line, each starting with a
+* keyword (progress, status, result).  Reader output goes to stderr with
+* --verbose.  The exit code says how it ended; see the EXIT_ codes.
+* --log appends the reflash's ReflashStats to a file as a line of JSON.
+* --wait waits for the port to be plugged in and starts the moment it
+* is, for a station where readers are connected one after another.
+* --verify checks the reader against the image afterwards, and --skip
+* leaves alone a reader that already has it.  Both are off by default.
+*
+* With --batch QUEUE, --port takes a list of ports and each goes through
+* the --stages (detect,reflash,macro,reboot by default, and verify with
+* --verify), --jobs at a time, one "job" line each at the end.  If QUEUE holds a batch
+* that was cut short, that is finished instead.
+*
+* Linux:   g++ -O2 -o reflash reflash.cpp -lpthread
+* Windows: build as a console program next to ReaderReflash.
+*/
+
+#if defined(_WIN32)
+#include "../common/ui/winclass.h"
+
+#include <limits.h>
+
+typedef unsigned char byte;
+
+using namespace winclass;
+
+#pragma comment(lib, "shlwapi.lib")
+#else
+#include <signal.h>
+#endif
+
+#include "compat.h"
+#include "comm.h"
+#include "ports.h"
+#include "srecord.h"
+#include "stats.h"
+#include "macro.h"
+#include "reader.h"
+#include "gang.h"
+#include "batch.h"
+
+enum {
+  EXIT_OK,
+  EXIT_USAGE,           // Bad command line.
+  EXIT_IMAGE,           // S-record file missing or corrupt.
+  EXIT_PORT,            // Cannot open serial port.
+  EXIT_REFLASH,         // Reader did not take the image.
+  EXIT_MACRO,           // Reader did not take the command file.
+  EXIT_CANCELLED,       // Interrupted.
+  EXIT_BATCH            // Some readers in a batch did not get through.
+};
+
+struct CliReader : public Reader
+{
+  BOOL _verbose;
+  int _percent;
+
+  CliReader() : _verbose(FALSE), _percent(-1) {}
+
+  virtual void Output(char *buf, int len)
+  {
+    if (_verbose == FALSE) { return; }
+    if (len < 0) { len = lstrlenA(buf); }
+    fwrite(buf, 1, len, stderr);
+    fflush(stderr);
+  }
+
+  virtual void Status(const TCHAR *msg, BOOL err = TRUE)
+  {
+    if (msg == NULL) { return; }
+    printf("status %s%" PRI_TS "\n", err ? "error " : "", msg);
+    fflush(stdout);
+  }
+
+  /*
+   * One line per percent, not per record.
+   */
+  virtual void Progress(int line, int total)
+  {
+    int percent = (total > 0) ? (int) ((double) line * 100 / total) : 0;
+
+    if (percent == _percent && line != total) { return; }
+    _percent = percent;
+    printf("progress %d/%d %d%%\n", line, total, percent);
+    fflush(stdout);
+  }
+};
+
+static CliReader reader;
+static BatchQueue *batch = NULL;
+
+#if defined(_WIN32)
+static BOOL WINAPI
+OnBreak(DWORD type)
+{
+  reader.Stop();
+  if (batch != NULL) { batch->Cancel(); }
+  return TRUE;
+}
+#else
+static void
+OnBreak(int sig)
+{
+  reader.Stop();
+  if (batch != NULL) { batch->Cancel(); }
+}
+#endif
+
+static int
+Usage()
+{
+  fprintf(stderr,
+      "usage: reflash --port PORT [--image FILE.s19] [--macro FILE.txt]\n"
+      "         [--baud N] [--max-baud N] [--line-delay MS] [--fixed-delay]\n"
+      "         [--window N] [--record-size N] [--cache DIR] [--log FILE]\n"
+      "         [--macro-depth N] [--unit N] [--set NAME=VALUE]...\n"
+      "         [--verify] [--skip] [--wait] [--verbose]\n"
+      "       reflash --batch QUEUE --port PORT,.. [--jobs N] [--stages S,..]\n"
+      "         [--reboot CMD] [options as above]\n"
+      "\n"
+      "exit codes: 0 ok, 1 usage, 2 bad image, 3 cannot open port,\n"
+      "            4 reflash failed, 5 command file failed, 6 cancelled,\n"
+      "            7 not every reader in the batch got through\n");
+  return EXIT_USAGE;
+}
+
+static int
+Result(int code, const char *msg)
+{
+  printf("result %d %s\n", code, msg);
+  fflush(stdout);
+  return code;
+}
+
+static const SRecordImage *
+LoadImage(const TCHAR *imageName, SRecordImage *file, SRecordImage *merged)
+{
+  if (file->Load(imageName) == FALSE) {
+    reader.Status(file->_error);
+    return NULL;
+  }
+  if (reader._tty.recordSize > 0) {
+    merged->Coalesce(file, reader._tty.recordSize);
+    return merged;
+  }
+  return file;
+}
+
+/*
+ * Until port is there, or Ctrl+C.  Told when ports come and go, so
+ * it does not poll; the timeout only notices Ctrl+C on Win32.
+ */
+static BOOL
+WaitForPort(const TCHAR *port)
+{
+  PortList ports;
+  BOOL watching;
+
+  ports.Refresh();
+#if defined(_WIN32)
+  watching = ports.Watch();
+#else
+  char dir[MAX_PATH], *p;
+
+  strcpy_t(dir, _countof(dir), port);
+  p = strrchr(dir, '/');
+  if (p == NULL) {
+    strcpy_t(dir, _countof(dir), ".");
+  } else {
+    p[(p == dir) ? 1 : 0] = '\0';
+  }
+  watching = ports.Watch(dir);
+#endif
+  if (ports.Has(port)) { return TRUE; }
+  if (watching == FALSE) {
+    reader.Status(_T("Cannot watch for ports"));
+    return FALSE;
+  }
+
+  reader.Status(_T("Waiting for the port"), 0);
+  while (reader._stop == FALSE) {
+    if (ports.Wait(CONSOLE_TIMEOUT) && ports.Has(port)) { return TRUE; }
+  }
+  return FALSE;
+}
+
+/*
+ * Take the ports in the comma separated list through the stages, or,
+ * given no ports, image or command file, finish the batch left in
+ * queueName.
+ */
+static int
+RunBatch(const TCHAR *queueName, const TCHAR *portList, int stages, const TCHAR *imageName,
+    const TCHAR *macroName, const char *reboot, int jobs, const TCHAR *logName)
+{
+  BatchQueue queue;
+  SRecordImage file, merged;
+  const SRecordImage *image = NULL;
+  TCHAR list[MAX_PATH], summary[128], last[128];
+  BOOL left;
+  const TCHAR *ports[BATCH_PORTS];
+  const char *unit = reader._vars.Get("unit");
+  char line[MAX_PATH * 2];
+  TCHAR *p;
+  int i, count;
+
+  left = queue.Load(queueName);
+  if (left && portList == NULL && imageName == NULL && macroName == NULL) {
+    sprintf_t(summary, _countof(summary), _T("Finishing the batch left in the queue file: %d readers"),
+        queue._count);
+    reader.Status(summary, 0);
+  } else {
+    if (portList == NULL) { return Usage(); }
+    if (left) { reader.Status(_T("Dropping the unfinished batch in the queue file"), 0); }
+    strcpy_t(list, _countof(list), portList);
+    for (p = list, count = 0; p != NULL && count < BATCH_PORTS; ) {
+      ports[count++] = p;
+      p = _tcschr(p, ',');
+      if (p != NULL) { *p++ = '\0'; }
+    }
+    if (queue.Create(queueName, ports, count, stages,
+        (imageName != NULL) ? imageName : _T(""), (macroName != NULL) ? macroName : _T(""),
+        reboot, (unit != NULL) ? atoi(unit) : 1) == FALSE) {
+      return Usage();
+    }
+  }
+
+  if (queue._imageName[0] != '\0') {
+    image = LoadImage(queue._imageName, &file, &merged);
+    if (image == NULL) { return Result(EXIT_IMAGE, "bad image"); }
+  }
+
+  if (jobs > 0) { queue._maxJobs = jobs; }
+  batch = &queue;
+  queue.Start(image, &reader._tty, reader._cacheDir, &reader._vars);
+
+  last[0] = '\0';
+  while (queue.Wait(CONSOLE_TIMEOUT) == FALSE) {
+    queue.Summary(summary, _countof(summary));
+    if (lstrcmpi(summary, last) != 0) {
+      reader.Status(summary, 0);
+      strcpy_t(last, _countof(last), summary);
+    }
+  }
+  batch = NULL;
+
+  for (i = 0; i < queue._count; i++) {
+    queue.Report(i, line, _countof(line));
+    printf("job %s", line);
+  }
+  if (logName != NULL) { queue.Log(logName); }
+  queue.Summary(summary, _countof(summary));
+  reader.Status(summary, queue.Failed() > 0);
+  queue.Finish();
+
+  if (reader._stop) { return Result(EXIT_CANCELLED, "cancelled"); }
+  if (queue.Failed() > 0) { return Result(EXIT_BATCH, "batch failed"); }
+  return Result(EXIT_OK, "ok");
+}
+
+#if defined(_WIN32) && defined(UNICODE)
+int
+wmain(int argc, TCHAR **argv)
+#else
+int
+main(int argc, TCHAR **argv)
+#endif
+{
+  const TCHAR *port = NULL, *imageName = NULL, *macroName = NULL, *logName = NULL;
+  const TCHAR *batchName = NULL;
+  SRecordImage file, merged;
+  const SRecordImage *image = &file;
+  char stageList[64], reboot[32];
+  int i, stages = 0, jobs = 0;
+  BOOL wait = FALSE;
+
+  reboot[0] = '\0';
+
+  for (i = 1; i < argc; i++) {
+    const TCHAR *arg = argv[i];
+    const TCHAR *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+    if (lstrcmpi(arg, _T("--verbose")) == 0) {
+      reader._verbose = TRUE;
+      continue;
+    }
+    if (lstrcmpi(arg, _T("--fixed-delay")) == 0) {
+      reader._tty.adaptive = FALSE;
+      continue;
+    }
+    if (lstrcmpi(arg, _T("--verify")) == 0) {
+      reader._tty.verify = TRUE;
+      continue;
+    }
+    if (lstrcmpi(arg, _T("--no-verify")) == 0) {
+      reader._tty.verify = FALSE;
+      continue;
+    }
+    if (lstrcmpi(arg, _T("--skip")) == 0) {
+      reader._tty.skip = TRUE;
+      continue;
+    }
+    if (lstrcmpi(arg, _T("--always")) == 0) {
+      reader._tty.skip = FALSE;
+      continue;
+    }
+    if (lstrcmpi(arg, _T("--wait")) == 0) {
+      wait = TRUE;
+      continue;
+    }
+    if (val == NULL) { return Usage(); }
+    i++;
+
+    if (lstrcmpi(arg, _T("--port")) == 0) {
+      port = val;
+    } else if (lstrcmpi(arg, _T("--image")) == 0) {
+      imageName = val;
+    } else if (lstrcmpi(arg, _T("--macro")) == 0) {
+      macroName = val;
+    } else if (lstrcmpi(arg, _T("--baud")) == 0) {
+      reader._tty.serial.baud = (DWORD) _ttoi(val);
+    } else if (lstrcmpi(arg, _T("--max-baud")) == 0) {
+      reader._tty.maxBaud = (DWORD) _ttoi(val);
+    } else if (lstrcmpi(arg, _T("--line-delay")) == 0) {
+      reader._tty.lineDelay = _ttoi(val);
+    } else if (lstrcmpi(arg, _T("--window")) == 0) {
+      reader._tty.window = _ttoi(val);
+    } else if (lstrcmpi(arg, _T("--record-size")) == 0) {
+      reader._tty.recordSize = _ttoi(val);
+    } else if (lstrcmpi(arg, _T("--macro-depth")) == 0) {
+      reader._tty.macroDepth = _ttoi(val);
+    } else if (lstrcmpi(arg, _T("--unit")) == 0) {
+      reader._vars.SetInt("unit", _ttoi(val));
+    } else if (lstrcmpi(arg, _T("--set")) == 0) {
+      if (reader._vars.Assign(val) == FALSE) { return Usage(); }
+    } else if (lstrcmpi(arg, _T("--cache")) == 0) {
+      strcpy_t(reader._cacheDir, _countof(reader._cacheDir), val);
+    } else if (lstrcmpi(arg, _T("--log")) == 0) {
+      logName = val;
+    } else if (lstrcmpi(arg, _T("--batch")) == 0) {
+      batchName = val;
+    } else if (lstrcmpi(arg, _T("--jobs")) == 0) {
+      jobs = _ttoi(val);
+    } else if (lstrcmpi(arg, _T("--stages")) == 0) {
+      StringCchPrintfA(stageList, _countof(stageList), "%" PRI_TS, val);
+      stages = BatchQueue::Stages(stageList);
+      if (stages <= 0) { return Usage(); }
+    } else if (lstrcmpi(arg, _T("--reboot")) == 0) {
+      StringCchPrintfA(reboot, _countof(reboot), "%" PRI_TS, val);
+    } else {
+      return Usage();
+    }
+  }
+
+#if defined(_WIN32)
+  SetConsoleCtrlHandler(OnBreak, TRUE);
+#else
+  signal(SIGINT, OnBreak);
+  signal(SIGTERM, OnBreak);
+#endif
+
+  if (batchName != NULL) {
+    if (stages == 0) {
+      stages = STAGE_ALL;
+      if (reader._tty.verify == FALSE) { stages &= ~(1 << STAGE_VERIFY); }
+    }
+    return RunBatch(batchName, port, stages, imageName, macroName, reboot, jobs, logName);
+  }
+  if (port == NULL || (imageName == NULL && macroName == NULL)) { return Usage(); }
+
+  // Check the image before touching the reader.
+  if (imageName != NULL) {
+    image = LoadImage(imageName, &file, &merged);
+    if (image == NULL) { return Result(EXIT_IMAGE, "bad image"); }
+  }
+
+  if (wait && WaitForPort(port) == FALSE) {
+    return Result(reader._stop ? EXIT_CANCELLED : EXIT_PORT, "cannot open port");
+  }
+  if (reader.Port_Open(port) == FALSE) {
+    return Result(EXIT_PORT, "cannot open port");
+  }
+
+  if (imageName != NULL) {
+    BOOL ok = reader.Reflash(image);
+
+    if (logName != NULL) { reader._stats.Log(logName, port, ok); }
+    if (ok == FALSE) {
+      return Result(reader._stop ? EXIT_CANCELLED : EXIT_REFLASH, "reflash failed");
+    }
+  }
+  if (macroName != NULL && reader.PlayMacro(macroName) == FALSE) {
+    return Result(reader._stop ? EXIT_CANCELLED : EXIT_MACRO, "command file failed");
+  }
+
+  return Result(EXIT_OK, "ok");
+}
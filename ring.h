@@ -0,0 +1,77 @@
+#if !defined(_RING_H)
+#define _RING_H
+
+/*
+ * ring.h --
+ *
+ * Lock-free byte ring for one producer thread and one consumer thread.
+ * Head and tail run freely and are only ever written by one side each,
+ * so neither side ever waits on the other.
+ */
+
+struct Ring
+{
+  char *_buf;
+  LONG _size;		/* Power of two. */
+  volatile LONG _head;	/* Next byte to put.  Written by producer. */
+  volatile LONG _tail;	/* Next byte to get.  Written by consumer. */
+
+  Ring(LONG size)
+  {
+    _buf = new char[size];
+    _size = size;
+    _head = _tail = 0;
+  }
+
+  ~Ring()
+  {
+    delete [] _buf;
+  }
+
+  LONG Used()
+  {
+    return _head - _tail;
+  }
+
+  /*
+   * Producer side.  Returns how many bytes fitted.
+   */
+  int Put(const char *src, int len)
+  {
+    LONG head = _head;
+    LONG room = _size - (head - _tail);
+    int i, n;
+
+    if (len > room) { len = room; }
+    for (i = 0; i < len; i += n) {
+      LONG at = (head + i) & (_size - 1);
+      n = min(len - i, (int) (_size - at));
+      memcpy(_buf + at, src + i, n);
+    }
+    // Bytes must be in place before the consumer can see them.
+    InterlockedExchange(&_head, head + len);
+    return len;
+  }
+
+  /*
+   * Consumer side.  Returns how many bytes were taken.
+   */
+  int Get(char *dst, int len)
+  {
+    LONG tail = _tail;
+    LONG used = _head - tail;
+    int i, n;
+
+    MemoryBarrier();
+    if (len > used) { len = used; }
+    for (i = 0; i < len; i += n) {
+      LONG at = (tail + i) & (_size - 1);
+      n = min(len - i, (int) (_size - at));
+      memcpy(dst + i, _buf + at, n);
+    }
+    InterlockedExchange(&_tail, tail + len);
+    return len;
+  }
+};
+
+#endif
@@ -0,0 +1,259 @@
+#if !defined(_SCROLLBACK_H)
+#define _SCROLLBACK_H
+
+/*
+ * scrollback.h --
+ *
+ * Everything the console has shown this session, for the console view
+ * to draw from and to be saved for a post-mortem.
+ *
+ * Text is kept in fixed size chunks, so appending costs the same however
+ * long the session.  Once SCROLL_CHUNKS are in memory, the oldest chunk
+ * is appended to a temporary spill file (deleted when closed) and its
+ * buffer reused.  If there is no spill file, the oldest chunk is lost.
+ *
+ * Text is addressed by its offset from the start of the session.  Where
+ * each of the last SCROLL_LINES lines starts is kept too, so any line
+ * can be found without scanning for it.
+ *
+ * Only used from the GUI thread.
+ */
+
+#define SCROLL_CHUNK            65536
+#define SCROLL_CHUNKS           256     /* 16 MB in memory. */
+#define SCROLL_LINES            (1 << 20)
+
+struct Scrollback
+{
+  char *_chunks[SCROLL_CHUNKS];	/* Circular; oldest at _first. */
+  int _first, _count;
+  int _used;			/* Bytes used in newest chunk. */
+
+  ULONGLONG _total;		/* Bytes appended. */
+
+  HANDLE _spill;		/* Older chunks, or INVALID_HANDLE_VALUE. */
+  DWORD _dropped;		/* Chunks lost for want of a spill file. */
+
+  ULONGLONG *_lines;		/* Circular; line starts, oldest at _lineFirst. */
+  int _lineFirst, _lineCount;
+  DWORD _lineBase;		/* Number of the oldest line kept. */
+  int _longest;			/* Bytes in the longest line. */
+
+  Scrollback()
+  {
+    int i;
+
+    for (i = 0; i < SCROLL_CHUNKS; i++) { _chunks[i] = NULL; }
+    _spill = INVALID_HANDLE_VALUE;
+    _lines = new ULONGLONG[SCROLL_LINES];
+    Clear();
+  }
+
+  ~Scrollback()
+  {
+    int i;
+
+    for (i = 0; i < SCROLL_CHUNKS; i++) { delete [] _chunks[i]; }
+    delete [] _lines;
+    if (_spill != INVALID_HANDLE_VALUE) { CloseHandle(_spill); }
+  }
+
+  /*
+   * Open the spill file.  Without it, history is bounded by memory.
+   */
+  BOOL Spill()
+  {
+    TCHAR dir[MAX_PATH], name[MAX_PATH];
+
+    if (_spill != INVALID_HANDLE_VALUE) { return TRUE; }
+    if (GetTempPath(_countof(dir), dir) == 0) { return FALSE; }
+    if (GetTempFileName(dir, _T("rdr"), 0, name) == 0) { return FALSE; }
+
+    _spill = CreateFile(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    return (_spill != INVALID_HANDLE_VALUE);
+  }
+
+  void Clear()
+  {
+    _first = _count = _used = 0;
+    _total = 0;
+    _dropped = 0;
+    _lineFirst = 0;
+    _lineCount = 1;
+    _lineBase = 0;
+    _lines[0] = 0;
+    _longest = 0;
+    if (_spill != INVALID_HANDLE_VALUE) {
+      SetFilePointer(_spill, 0, NULL, FILE_BEGIN);
+      SetEndOfFile(_spill);
+    }
+  }
+
+  /*
+   * Start a new chunk, moving the oldest out of memory if need be.
+   */
+  void NewChunk()
+  {
+    int i;
+    DWORD wrote;
+
+    if (_count == SCROLL_CHUNKS) {
+      if (_spill != INVALID_HANDLE_VALUE) {
+        WriteFile(_spill, _chunks[_first], SCROLL_CHUNK, &wrote, NULL);
+      } else {
+        _dropped++;
+        while (_lineCount > 1 && _lines[(_lineFirst + 1) % SCROLL_LINES] <= Start()) {
+          DropLine();
+        }
+      }
+      _first = (_first + 1) % SCROLL_CHUNKS;
+      _count--;
+    }
+
+    i = (_first + _count) % SCROLL_CHUNKS;
+    if (_chunks[i] == NULL) { _chunks[i] = new char[SCROLL_CHUNK]; }
+    _count++;
+    _used = 0;
+  }
+
+  void DropLine()
+  {
+    _lineFirst = (_lineFirst + 1) % SCROLL_LINES;
+    _lineCount--;
+    _lineBase++;
+  }
+
+  void Append(const char *src, int len)
+  {
+    const char *nl;
+    int n;
+
+    while (len > 0) {
+      if (_count == 0 || _used == SCROLL_CHUNK) { NewChunk(); }
+
+      n = min(len, SCROLL_CHUNK - _used);
+      memcpy(_chunks[(_first + _count - 1) % SCROLL_CHUNKS] + _used, src, n);
+      for (nl = src; (nl = (const char *) memchr(nl, '\n', n - (nl - src))) != NULL; nl++) {
+        if (_lineCount == SCROLL_LINES) { DropLine(); }
+        _lines[(_lineFirst + _lineCount) % SCROLL_LINES] = _total + (nl - src) + 1;
+        _lineCount++;
+      }
+      _used += n;
+      _total += n;
+      src += n;
+      len -= n;
+    }
+    n = (int) min(_total - LineStart(LastLine()), (ULONGLONG) INT_MAX);
+    if (n > _longest) { _longest = n; }
+  }
+
+  /*
+   * Take back the last byte, unless it ended a line.  For backspace.
+   */
+  BOOL Unput()
+  {
+    if (_used == 0 || _total == LineStart(LastLine())) { return FALSE; }
+    _used--;
+    _total--;
+    return TRUE;
+  }
+
+  /*
+   * First offset still held.
+   */
+  ULONGLONG Start()
+  {
+    return (ULONGLONG) _dropped * SCROLL_CHUNK;
+  }
+
+  DWORD FirstLine()
+  {
+    return _lineBase;
+  }
+
+  DWORD LastLine()
+  {
+    return _lineBase + _lineCount - 1;
+  }
+
+  /*
+   * Line is between FirstLine() and LastLine().  Its end is the start
+   * of the next, so includes the newline.
+   */
+  ULONGLONG LineStart(DWORD line)
+  {
+    return max(_lines[(_lineFirst + (line - _lineBase)) % SCROLL_LINES], Start());
+  }
+
+  ULONGLONG LineEnd(DWORD line)
+  {
+    return (line == LastLine()) ? _total : LineStart(line + 1);
+  }
+
+  /*
+   * Copy out len bytes from offset at, from memory or the spill file.
+   * Returns how many there were.
+   */
+  int Read(ULONGLONG at, char *dst, int len)
+  {
+    ULONGLONG mem = _total - ((_count == 0) ? 0 : (ULONGLONG) (_count - 1) * SCROLL_CHUNK + _used);
+    LARGE_INTEGER pos;
+    DWORD read;
+    int n, got = 0;
+
+    if (at < Start()) { return 0; }
+
+    while (len > 0 && at < _total) {
+      if (at < mem) {
+        if (_spill == INVALID_HANDLE_VALUE) { break; }
+        pos.QuadPart = at - Start();
+        SetFilePointerEx(_spill, pos, NULL, FILE_BEGIN);
+        n = (int) min((ULONGLONG) len, mem - at);
+        if (ReadFile(_spill, dst, n, &read, NULL) == FALSE) { read = 0; }
+        SetFilePointer(_spill, 0, NULL, FILE_END);
+        if (read == 0) { break; }
+        n = read;
+      } else {
+        int i = (int) ((at - mem) / SCROLL_CHUNK), off = (int) ((at - mem) % SCROLL_CHUNK);
+
+        n = (int) min((ULONGLONG) min(len, SCROLL_CHUNK - off), _total - at);
+        memcpy(dst, _chunks[(_first + i) % SCROLL_CHUNKS] + off, n);
+      }
+      dst += n;
+      at += n;
+      len -= n;
+      got += n;
+    }
+    return got;
+  }
+
+  /*
+   * Write all of it, oldest first.
+   */
+  BOOL Save(HANDLE out)
+  {
+    char *tmp;
+    DWORD read, wrote;
+    int i;
+    BOOL ok = TRUE;
+
+    if (_spill != INVALID_HANDLE_VALUE) {
+      tmp = new char[SCROLL_CHUNK];
+      SetFilePointer(_spill, 0, NULL, FILE_BEGIN);
+      while (ok && ReadFile(_spill, tmp, SCROLL_CHUNK, &read, NULL) && read > 0) {
+        ok = WriteFile(out, tmp, read, &wrote, NULL);
+      }
+      SetFilePointer(_spill, 0, NULL, FILE_END);
+      delete [] tmp;
+    }
+
+    for (i = 0; ok && i < _count; i++) {
+      int len = (i == _count - 1) ? _used : SCROLL_CHUNK;
+      ok = WriteFile(out, _chunks[(_first + i) % SCROLL_CHUNKS], len, &wrote, NULL);
+    }
+    return ok;
+  }
+};
+
+#endif
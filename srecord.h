@@ -0,0 +1,607 @@
+#if !defined(_SRECORD_H)
+#define _SRECORD_H
+
+/*
+ * srecord.h --
+ *
+ * Motorola S-record image, loaded and checked once before any reader is
+ * touched.  Every record is kept twice in two contiguous buffers: the
+ * decoded address and data, and the line exactly as it goes down the
+ * wire, "\r\n" and all.
+ *
+ * Once loaded an image is never modified, so one image can be shared by
+ * any number of Readers on any number of threads.  Coalesce() makes a
+ * new image from an old one with short data records merged.
+ *
+ * Loading also works out the CRC-32 of each run of contiguous data, so
+ * what a reader holds can be checked against the image without sending
+ * it again.
+ */
+
+#define SREC_MAX_COUNT		255	/* Byte count field is one byte. */
+
+struct SRecord
+{
+  int type;		/* 0-9, from the S0..S9 tag. */
+  DWORD addr;
+  int data;		/* Offset of data bytes in SRecordImage::_data. */
+  int dataLen;
+  int text;		/* Offset of wire-ready line in SRecordImage::_text. */
+  int textLen;
+  int srcLine;		/* Line number in the file, for error messages. */
+};
+
+struct SRecordRange
+{
+  DWORD addr;
+  DWORD len;
+  DWORD crc;		/* CRC-32 of the len bytes from addr. */
+};
+
+struct SRecordImage
+{
+  SRecord *_recs;
+  int _count;
+
+  char *_text;		/* All lines, each ending in "\r\n". */
+  int _textLen;
+
+  byte *_data;		/* All data bytes, in record order. */
+  int _dataLen;
+
+  SRecordRange *_ranges;	/* Contiguous data, in address order. */
+  int _rangeCount;
+
+  TCHAR _error[128];	/* Why Load() failed. */
+
+  SRecordImage()
+  {
+    _recs = NULL;
+    _text = NULL;
+    _data = NULL;
+    _ranges = NULL;
+    Free();
+  }
+
+  ~SRecordImage()
+  {
+    Free();
+  }
+
+  void Free()
+  {
+    delete [] _recs;
+    delete [] _text;
+    delete [] _data;
+    delete [] _ranges;
+
+    _recs = NULL;
+    _count = 0;
+    _text = NULL;
+    _textLen = 0;
+    _data = NULL;
+    _dataLen = 0;
+    _ranges = NULL;
+    _rangeCount = 0;
+    _error[0] = '\0';
+  }
+
+  /*
+   * Wire-ready line for record i, "\r\n" included.
+   */
+  const char *Line(int i, int *len) const
+  {
+    *len = _recs[i].textLen;
+    return _text + _recs[i].text;
+  }
+
+  const byte *Data(int i) const
+  {
+    return _data + _recs[i].data;
+  }
+
+  /*
+   * Size of address field for each record type.  0 means the type is
+   * not valid.
+   */
+  static int AddrSize(int type)
+  {
+    static const int size[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+
+    return size[type];
+  }
+
+  static int HexDigit(char ch)
+  {
+    if (ch >= '0' && ch <= '9') { return ch - '0'; }
+    if (ch >= 'A' && ch <= 'F') { return ch - 'A' + 10; }
+    if (ch >= 'a' && ch <= 'f') { return ch - 'a' + 10; }
+    return -1;
+  }
+
+  static int HexByte(const char *src)
+  {
+    int hi = HexDigit(src[0]);
+    int lo = HexDigit(src[1]);
+
+    if (hi < 0 || lo < 0) { return -1; }
+    return (hi << 4) | lo;
+  }
+
+  static BOOL IsData(int type)
+  {
+    return (type >= 1) && (type <= 3);
+  }
+
+  /*
+   * Append a record, formatting its line and checksum.  Room must
+   * already have been allocated.
+   */
+  void Add(int type, DWORD addr, const byte *data, int len, int srcLine)
+  {
+    static const char hex[] = "0123456789ABCDEF";
+    SRecord *rec = &_recs[_count++];
+    int i, n, count, sum;
+    char *p;
+
+    n = AddrSize(type);
+    count = n + len + 1;
+
+    rec->type = type;
+    rec->addr = addr;
+    rec->srcLine = srcLine;
+    rec->data = _dataLen;
+    rec->dataLen = len;
+    memcpy(_data + _dataLen, data, len);
+    _dataLen += len;
+
+    p = _text + _textLen;
+    *p++ = 'S';
+    *p++ = (char) ('0' + type);
+    *p++ = hex[count >> 4];
+    *p++ = hex[count & 15];
+    sum = count;
+    for (i = n - 1; i >= 0; i--) {
+      byte b = (byte) (addr >> (i * 8));
+      *p++ = hex[b >> 4];
+      *p++ = hex[b & 15];
+      sum += b;
+    }
+    for (i = 0; i < len; i++) {
+      *p++ = hex[data[i] >> 4];
+      *p++ = hex[data[i] & 15];
+      sum += data[i];
+    }
+    sum = ~sum & 0xff;
+    *p++ = hex[sum >> 4];
+    *p++ = hex[sum & 15];
+    *p++ = '\r';
+    *p++ = '\n';
+    *p = '\0';
+
+    rec->text = _textLen;
+    rec->textLen = (int) (p - (_text + _textLen));
+    _textLen += rec->textLen;
+  }
+
+  /*
+   * Make this a copy of src with runs of data records at contiguous
+   * addresses merged into records of up to maxData bytes, which should
+   * be as long as the bootloader will take.  Records are only merged
+   * with others of the same type, and a merged record starts at the
+   * address of the first, so S1/S2/S3 forms never need to change.
+   * The S5/S6 record count is redone to match.
+   */
+  void Coalesce(const SRecordImage *src, int maxData)
+  {
+    int i, j, len, max, type, data;
+    DWORD addr;
+
+    Free();
+
+    _recs = new SRecord[src->_count + 1];
+    _text = new char[src->_textLen + 16];
+    _data = new byte[src->_dataLen + 1];
+
+    for (i = 0; i < src->_count; i = j) {
+      const SRecord *rec = &src->_recs[i];
+      type = rec->type;
+
+      if (type == 5 || type == 6) {
+        // Redone below, once we know how many data records there are.
+        j = i + 1;
+        continue;
+      }
+      if (!IsData(type)) {
+        Add(type, rec->addr, src->Data(i), rec->dataLen, rec->srcLine);
+        j = i + 1;
+        continue;
+      }
+
+      // Take as many following records as fit and carry on from here.
+      max = maxData;
+      if (max > SREC_MAX_COUNT - AddrSize(type) - 1) { max = SREC_MAX_COUNT - AddrSize(type) - 1; }
+      len = rec->dataLen;
+      addr = rec->addr + rec->dataLen;
+      for (j = i + 1; j < src->_count; j++) {
+        const SRecord *next = &src->_recs[j];
+        if (next->type != type || next->addr != addr) { break; }
+        if (len + next->dataLen > max) { break; }
+        len += next->dataLen;
+        addr += next->dataLen;
+      }
+
+      // Source data of consecutive records is contiguous in src->_data.
+      Add(type, rec->addr, src->Data(i), len, rec->srcLine);
+    }
+
+    // Put the record count back in, just before the termination record.
+    for (i = 0; i < src->_count; i++) {
+      if (src->_recs[i].type == 5 || src->_recs[i].type == 6) { break; }
+    }
+    if (i < src->_count) {
+      byte none = 0;
+      int srcLine = src->_recs[i].srcLine;
+
+      for (data = 0, j = 0; j < _count; j++) {
+        if (IsData(_recs[j].type)) { data++; }
+      }
+      type = (data > 0xffff) ? 6 : 5;
+
+      // Find the termination record, if any, and slide it down one.
+      for (j = _count; j > 0 && _recs[j - 1].type >= 7; j--) {}
+      if (j < _count) {
+        SRecord term = _recs[j];
+        _count = j;
+        _textLen = term.text;
+        _dataLen = term.data;
+        Add(type, (DWORD) data, &none, 0, srcLine);
+        Add(term.type, term.addr, &none, 0, term.srcLine);
+      } else {
+        Add(type, (DWORD) data, &none, 0, srcLine);
+      }
+    }
+    Fingerprint();
+  }
+
+  static int CompareAddr(const void *a, const void *b)
+  {
+    DWORD x = ((const SRecord *) a)->addr;
+    DWORD y = ((const SRecord *) b)->addr;
+
+    return (x < y) ? -1 : (x > y);
+  }
+
+  /*
+   * Does was hold exactly these bytes at addr?  sorted is was's data
+   * records in address order.
+   */
+  static BOOL Same(const SRecordImage *was, const SRecord *sorted, int count,
+      DWORD addr, const byte *data, int len)
+  {
+    const SRecord *rec;
+    int lo, hi, mid, n;
+
+    while (len > 0) {
+      // Last record starting at or before addr.
+      for (lo = 0, hi = count; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        if (sorted[mid].addr <= addr) { lo = mid + 1; } else { hi = mid; }
+      }
+      if (lo == 0) { return FALSE; }
+
+      rec = &sorted[lo - 1];
+      if (addr - rec->addr >= (DWORD) rec->dataLen) { return FALSE; }
+
+      n = rec->dataLen - (int) (addr - rec->addr);
+      if (n > len) { n = len; }
+      if (memcmp(was->_data + rec->data + (addr - rec->addr), data, n) != 0) {
+        return FALSE;
+      }
+      addr += n;
+      data += n;
+      len -= n;
+    }
+    return TRUE;
+  }
+
+  /*
+   * Make this the part of now that differs from was: every data record
+   * of now that was does not already hold byte for byte, plus the
+   * header and termination records.  There is no S5 record count,
+   * since it is optional and would be misleading.
+   *
+   * Returns the number of data records left to send.
+   */
+  int Delta(const SRecordImage *now, const SRecordImage *was)
+  {
+    SRecord *sorted;
+    int i, count, changed;
+
+    Free();
+
+    _recs = new SRecord[now->_count + 1];
+    _text = new char[now->_textLen + 1];
+    _data = new byte[now->_dataLen + 1];
+
+    sorted = new SRecord[was->_count + 1];
+    for (i = count = 0; i < was->_count; i++) {
+      if (IsData(was->_recs[i].type)) { sorted[count++] = was->_recs[i]; }
+    }
+    qsort(sorted, count, sizeof(sorted[0]), CompareAddr);
+
+    for (i = changed = 0; i < now->_count; i++) {
+      const SRecord *rec = &now->_recs[i];
+
+      if (rec->type == 5 || rec->type == 6) { continue; }
+      if (IsData(rec->type)) {
+        if (Same(was, sorted, count, rec->addr, now->Data(i), rec->dataLen)) { continue; }
+        changed++;
+      }
+      Add(rec->type, rec->addr, now->Data(i), rec->dataLen, rec->srcLine);
+    }
+
+    delete [] sorted;
+    return changed;
+  }
+
+  /*
+   * CRC-32 (IEEE 802.3, as zip) of len bytes, carrying on from crc, 0 to
+   * start.  Four bytes per table step rather than one; the tables are
+   * the same whoever builds them, so racing threads do no harm.
+   */
+  static DWORD Crc32(DWORD crc, const byte *p, DWORD len)
+  {
+    static DWORD table[4][256];
+    static volatile LONG ready = 0;
+    DWORD c;
+    int i, k;
+
+    if (ready == 0) {
+      for (i = 0; i < 256; i++) {
+        c = (DWORD) i;
+        for (k = 0; k < 8; k++) { c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1; }
+        table[0][i] = c;
+      }
+      for (i = 0; i < 256; i++) {
+        for (k = 1; k < 4; k++) {
+          table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+        }
+      }
+      MemoryBarrier();
+      ready = 1;
+    }
+
+    crc = ~crc;
+    for (; len >= 4; p += 4, len -= 4) {
+      crc ^= (DWORD) p[0] | ((DWORD) p[1] << 8) | ((DWORD) p[2] << 16) | ((DWORD) p[3] << 24);
+      crc = table[3][crc & 0xff] ^ table[2][(crc >> 8) & 0xff]
+          ^ table[1][(crc >> 16) & 0xff] ^ table[0][crc >> 24];
+    }
+    for (; len > 0; p++, len--) { crc = table[0][(crc ^ *p) & 0xff] ^ (crc >> 8); }
+    return ~crc;
+  }
+
+  /*
+   * Work out _ranges: data records in address order, with records that
+   * follow on from each other run together.
+   */
+  void Fingerprint()
+  {
+    SRecord *sorted;
+    SRecordRange *r = NULL;
+    int i, count;
+
+    delete [] _ranges;
+    _ranges = new SRecordRange[_count + 1];
+    _rangeCount = 0;
+
+    sorted = new SRecord[_count + 1];
+    for (i = count = 0; i < _count; i++) {
+      if (IsData(_recs[i].type) && _recs[i].dataLen > 0) { sorted[count++] = _recs[i]; }
+    }
+    qsort(sorted, count, sizeof(sorted[0]), CompareAddr);
+
+    for (i = 0; i < count; i++) {
+      const SRecord *rec = &sorted[i];
+
+      if (r == NULL || rec->addr != r->addr + r->len) {
+        r = &_ranges[_rangeCount++];
+        r->addr = rec->addr;
+        r->len = 0;
+        r->crc = 0;
+      }
+      r->crc = Crc32(r->crc, _data + rec->data, rec->dataLen);
+      r->len += rec->dataLen;
+    }
+
+    delete [] sorted;
+  }
+
+  /*
+   * Make this the records of src from record from on, to pick up a
+   * transfer that was cut short.  src's S0 header records go in front
+   * so the loader still sees a whole file; any S5/S6 count is dropped,
+   * as for Delta().  index[i] is set to the record of src that record i
+   * came from.
+   */
+  void Rest(const SRecordImage *src, int from, int *index)
+  {
+    int i;
+
+    Free();
+
+    _recs = new SRecord[src->_count + 1];
+    _text = new char[src->_textLen + 1];
+    _data = new byte[src->_dataLen + 1];
+
+    for (i = 0; i < src->_count; i++) {
+      const SRecord *rec = &src->_recs[i];
+
+      if (rec->type == 5 || rec->type == 6) { continue; }
+      if (i < from && rec->type != 0) { continue; }
+      index[_count] = i;
+      Add(rec->type, rec->addr, src->Data(i), rec->dataLen, rec->srcLine);
+    }
+  }
+
+  /*
+   * Write the image out as an S-record file.
+   */
+  BOOL Save(const TCHAR *fileName) const
+  {
+    FILE *f;
+    BOOL ok;
+
+    f = _tfopen(fileName, _T("wb"));
+    if (f == NULL) { return FALSE; }
+
+    ok = (fwrite(_text, 1, _textLen, f) == (size_t) _textLen);
+    if (fclose(f) != 0) { ok = FALSE; }
+    return ok;
+  }
+
+  /*
+   * Load S-record file.  Blank lines are skipped; anything else, to
+   * the end of the file, must be a well-formed record with a good
+   * checksum.
+   *
+   * On failure, _error says what was wrong and where.
+   */
+  BOOL Load(const TCHAR *fileName)
+  {
+    FILE *f = NULL;
+    char *src = NULL;
+    long size;
+    int i, lines, lineNo;
+    char *p, *end;
+
+    Free();
+
+    if ((fileName == NULL) || (fileName[0] == '\0')) { goto badfile; }
+
+    f = _tfopen(fileName, _T("rb"));
+    if (f == NULL) { goto badfile; }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0) { goto badfile; }
+
+    src = new char[size + 1];
+    if ((long) fread(src, 1, size, f) != size) { goto badfile; }
+    src[size] = '\0';
+    fclose(f);
+    f = NULL;
+
+    // Sizes are bounded by the file, so allocate everything up front.
+    //
+    lines = 1;
+    for (i = 0; i < size; i++) {
+      if (src[i] == '\n') { lines++; }
+    }
+    _recs = new SRecord[lines];
+    _text = new char[size + 2 * lines + 1];
+    _data = new byte[size / 2 + 1];
+
+    lineNo = 0;
+    for (p = src; p < src + size; p = end) {
+      SRecord *rec;
+      int len, count, sum, b, n;
+
+      lineNo++;
+      for (end = p; end < src + size && *end != '\n'; end++) {}
+      len = (int) (end - p);
+      if (end < src + size) { end++; }
+
+      // Trim, like StrTrimA(line, "\r\n\t ").
+      while (len > 0 && (*p == ' ' || *p == '\t' || *p == '\r')) { p++; len--; }
+      while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t' || p[len - 1] == '\r')) { len--; }
+      if (len == 0) { continue; }
+
+      if (memchr(p, '\0', len) != NULL) {
+        sprintf_t(_error, _countof(_error), _T("Line %d: NUL in record"), lineNo);
+        goto err;
+      }
+      if (len < 4 || p[0] != 'S' || p[1] < '0' || p[1] > '9'
+          || AddrSize(p[1] - '0') == 0) {
+        sprintf_t(_error, _countof(_error), _T("Line %d: not an S-record"), lineNo);
+        goto err;
+      }
+
+      rec = &_recs[_count];
+      rec->type = p[1] - '0';
+      rec->srcLine = lineNo;
+
+      count = HexByte(p + 2);
+      if (count < 0 || len != 4 + count * 2) {
+        sprintf_t(_error, _countof(_error), _T("Line %d: bad record length"), lineNo);
+        goto err;
+      }
+      n = AddrSize(rec->type);
+      if (count < n + 1) {
+        sprintf_t(_error, _countof(_error), _T("Line %d: record too short"), lineNo);
+        goto err;
+      }
+
+      sum = count;
+      rec->addr = 0;
+      for (i = 0; i < count; i++) {
+        b = HexByte(p + 4 + i * 2);
+        if (b < 0) {
+          sprintf_t(_error, _countof(_error), _T("Line %d: bad hex digit"), lineNo);
+          goto err;
+        }
+        sum += b;
+        if (i < n) {
+          rec->addr = (rec->addr << 8) | b;
+        } else if (i < count - 1) {
+          _data[_dataLen++] = (byte) b;
+        }
+      }
+      if ((sum & 0xff) != 0xff) {
+        sprintf_t(_error, _countof(_error), _T("Line %d: bad checksum"), lineNo);
+        goto err;
+      }
+      rec->dataLen = count - n - 1;
+      rec->data = _dataLen - rec->dataLen;
+
+      rec->text = _textLen;
+      rec->textLen = len + 2;
+      memcpy(_text + _textLen, p, len);
+      _textLen += len;
+      _text[_textLen++] = '\r';
+      _text[_textLen++] = '\n';
+
+      _count++;
+    }
+    _text[_textLen] = '\0';
+
+    delete [] src;
+
+    if (_count == 0) {
+      strcpy_t(_error, _countof(_error), _T("No S-records in file"));
+      return FALSE;
+    }
+    Fingerprint();
+    return TRUE;
+
+badfile:
+    if (f != NULL) { fclose(f); }
+    strcpy_t(_error, _countof(_error), _T("Cannot open file"));
+    delete [] src;
+    return FALSE;
+
+err:
+    delete [] src;
+    {
+      TCHAR tmp[128];
+      strcpy_t(tmp, _countof(tmp), _error);
+      Free();
+      strcpy_t(_error, _countof(_error), tmp);
+    }
+    return FALSE;
+  }
+};
+
+#endif
@@ -0,0 +1,162 @@
+#if !defined(_STATS_H)
+#define _STATS_H
+
+/*
+ * stats.h --
+ *
+ * Where the time went in one reflash: how long each phase took, bytes
+ * each way, retries, XOFF stalls and a histogram of how long each line
+ * took to be answered.  Reader::Reflash() fills one in as it goes; the
+ * owner shows Summary() and appends Log() to a session log.
+ */
+
+enum {
+  PHASE_CONNECT,        /* Until the reader first answers. */
+  PHASE_PROMPT,         /* Getting it ready to take a file. */
+  PHASE_ERASE,
+  PHASE_PROGRAM,
+  PHASE_VERIFY,
+  PHASE_REBOOT,         /* Until the CMD> shell is back. */
+  PHASES
+};
+
+#define LATENCY_BUCKETS         12      /* <1, 1, 2, 4 .. 512, 1024+ ms */
+
+struct ReflashStats
+{
+  DWORD _start;         /* When Start() was called. */
+  DWORD _mark;          /* When the current phase began. */
+  int _phase;           /* PHASE_xxx, or -1 when stopped. */
+  DWORD _phaseMs[PHASES];
+  DWORD _elapsed;
+
+  DWORD _baud;          /* Fastest rate the link ran at. */
+  DWORD _bytesSent, _bytesRecv;
+  DWORD _programSent;   /* Of _bytesSent, while in PHASE_PROGRAM. */
+  int _lines;           /* Records sent. */
+  int _retries;         /* Prompts asked for again. */
+  int _stalls;          /* Lines sent while held by XOFF. */
+  int _backoffs;        /* Line delay raised. */
+  int _latency[LATENCY_BUCKETS];
+
+  ReflashStats()
+  {
+    Start();
+    _phase = -1;
+  }
+
+  void Start()
+  {
+    int i;
+
+    _start = _mark = GetTickCount();
+    _phase = PHASE_CONNECT;
+    for (i = 0; i < PHASES; i++) { _phaseMs[i] = 0; }
+    _elapsed = 0;
+    _baud = 0;
+    _bytesSent = _bytesRecv = _programSent = 0;
+    _lines = _retries = _stalls = _backoffs = 0;
+    for (i = 0; i < LATENCY_BUCKETS; i++) { _latency[i] = 0; }
+  }
+
+  /*
+   * End the current phase and start another, or none with -1.
+   */
+  void Phase(int phase)
+  {
+    DWORD now = GetTickCount();
+
+    if (_phase >= 0) {
+      _phaseMs[_phase] += now - _mark;
+      _elapsed = now - _start;
+    }
+    _phase = phase;
+    _mark = now;
+  }
+
+  void Stop()
+  {
+    Phase(-1);
+  }
+
+  void Sent(int len)
+  {
+    _bytesSent += len;
+    if (_phase == PHASE_PROGRAM) { _programSent += len; }
+  }
+
+  void Latency(DWORD ms)
+  {
+    int i;
+
+    for (i = 0; (i < LATENCY_BUCKETS - 1) && (ms >= (1u << i)); i++) {}
+    _latency[i]++;
+  }
+
+  /*
+   * Upper bound in ms of the bucket holding the pct'th percentile line.
+   */
+  int Percentile(int pct)
+  {
+    int i, n = 0, total = 0;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) { total += _latency[i]; }
+    if (total == 0) { return 0; }
+
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+      n += _latency[i];
+      if (n * 100 >= total * pct) { break; }
+    }
+    return 1 << i;
+  }
+
+  /*
+   * e.g. "12.3 s, 4.6 KB/s, p50 4 ms, p99 32 ms, 2 stalls, 1 retry",
+   * the rate being that of programming alone.
+   */
+  void Summary(TCHAR *buf, int len)
+  {
+    DWORD ms = _phaseMs[PHASE_PROGRAM];
+    DWORD rate = (ms > 0) ? (DWORD) ((double) _programSent * 1000 / ms) : 0;
+
+    sprintf_t(buf, len, _T("%d.%d s, %d.%d KB/s, p50 %d ms, p99 %d ms, %d stall%s, %d retr%s"),
+        (int) (_elapsed / 1000), (int) (_elapsed / 100) % 10,
+        (int) (rate / 1024), (int) (rate * 10 / 1024) % 10,
+        Percentile(50), Percentile(99),
+        _stalls, (_stalls == 1) ? _T("") : _T("s"),
+        _retries, (_retries == 1) ? _T("y") : _T("ies"));
+  }
+
+  /*
+   * Append one line of JSON for this reflash to fileName.
+   */
+  BOOL Log(const TCHAR *fileName, const TCHAR *port, BOOL ok)
+  {
+    static const char *names[PHASES] = {
+      "connect", "prompt", "erase", "program", "verify", "reboot"
+    };
+    FILE *f;
+    int i;
+
+    f = _tfopen(fileName, _T("a"));
+    if (f == NULL) { return FALSE; }
+
+    fprintf(f, "{\"port\": \"%" PRI_TS "\", \"ok\": %s, \"ms\": %u, \"phases\": {",
+        port, ok ? "true" : "false", (unsigned) _elapsed);
+    for (i = 0; i < PHASES; i++) {
+      fprintf(f, "%s\"%s\": %u", (i > 0) ? ", " : "", names[i], (unsigned) _phaseMs[i]);
+    }
+    fprintf(f, "}, \"baud\": %u, \"sent\": %u, \"recv\": %u, \"lines\": %d, \"retries\": %d,"
+        " \"stalls\": %d, \"backoffs\": %d, \"latency\": [",
+        (unsigned) _baud, (unsigned) _bytesSent, (unsigned) _bytesRecv, _lines, _retries,
+        _stalls, _backoffs);
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+      fprintf(f, "%s%d", (i > 0) ? ", " : "", _latency[i]);
+    }
+    fprintf(f, "]}\n");
+
+    return fclose(f) == 0;
+  }
+};
+
+#endif